@@ -0,0 +1,263 @@
+	/******************************************************************************
+	*
+	*	pibench: measures the acquisition path of the driver with the simulated
+	*	board (insmod pipci.ko SIMULATE=<fps> SIM_FRAME_KB=<kb>), through the
+	*	same calls as an application: IOCTL_PCI_ALLOCATE_SG_TABLE, then for each
+	*	frame IOCTL_PCI_WAIT_FRAMES, IOCTL_PCI_GET_IRQS and IOCTL_PCI_TRANSFER_DATA.
+	*	Reports the throughput of the copies, the CPU time per frame and the
+	*	latency from the interrupt handler (the EOF event) to the application.
+	*
+	*	Build: make pibench
+	*	Usage: pibench [-d device] [-k frame KB] [-n frames]
+	*
+	******************************************************************************/
+	#include <stdio.h>
+	#include <stdlib.h>
+	#include <string.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <time.h>
+	#include <errno.h>
+	#include <sys/ioctl.h>
+	#include <sys/resource.h>
+
+	#include "pidriver.h"
+
+	/* The simulated board's TAXI control register (see pipci.c) */
+	#define CTRL_WR_PCI	0x0
+	#define RCV_CLR		0x10
+	#define IRQ_EN		0x80
+
+	static struct pi_userdma_info dma;
+	static unsigned long long *latencies;
+	static unsigned long nlatencies, max_latencies;
+
+	static unsigned long long now_ns( void )
+	{
+		struct timespec ts;
+
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	static double cpu_seconds( void )
+	{
+		struct rusage ru;
+
+		getrusage( RUSAGE_SELF, &ru );
+		return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	}
+
+	static int write_ctrl( int fd, unsigned long base2, unsigned long value )
+	{
+		struct pi_pci_io io;
+
+		memset( &io, 0, sizeof(io) );
+		io.port = base2 + CTRL_WR_PCI;
+		io.data.dword_data = value;
+		return ioctl( fd, IOCTL_PCI_WRITE_DWORD, &io );
+	}
+
+	/*
+	 * The nodes of the next frame, where the simulated board writes it: after
+	 * the previous one, back at the first block at the end of the buffer.
+	 */
+	static unsigned int frame_nodes( struct pi_dma_node *nodes, unsigned long frame_size,
+					 unsigned long *block, unsigned long *offset )
+	{
+		unsigned long left = frame_size, n;
+		unsigned int count = 0;
+
+		while (left > 0)
+		{
+			if (*block >= dma.numberofentries || *offset >= dma.nodes[*block].physsize)
+			{
+				*block = 0;
+				*offset = 0;
+			}
+			n = dma.nodes[*block].physsize - *offset;
+			if (n > left)
+				n = left;
+			nodes[count].physaddr = (char *)dma.nodes[*block].physaddr + *offset;
+			nodes[count].physsize = n;
+			nodes[count].next = NULL;
+			if (count > 0)
+				nodes[count - 1].next = &nodes[count];
+			count++;
+			*offset += n;
+			left -= n;
+			if (*offset >= dma.nodes[*block].physsize)
+			{
+				(*block)++;
+				*offset = 0;
+			}
+		}
+		return count;
+	}
+
+	/* Latency of the end of frames noted by the driver since the last call */
+	static void read_latencies( int fd, unsigned long long now )
+	{
+		static struct pi_event events[PI_EVENT_RING];
+		struct pi_events req;
+		unsigned int i;
+
+		req.events = events;
+		req.count = PI_EVENT_RING;
+		if (ioctl( fd, IOCTL_PCI_READ_EVENTS, &req ) < 0)
+			return;
+		for (i = 0; i < req.returned; i++)
+			if (events[i].type == PI_EVENT_EOF && nlatencies < max_latencies)
+				latencies[nlatencies++] = now - events[i].timestamp;
+	}
+
+	static int compare( const void *a, const void *b )
+	{
+		unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+		return x < y ? -1 : x > y;
+	}
+
+	int main( int argc, char **argv )
+	{
+		const char *device = "/dev/" DEVICE_FILE_NAME "0";
+		unsigned long frame_kb = 1024, frames = 1000, frame_size;
+		unsigned long block = 0, offset = 0, done = 0, skipped = 0, bad = 0;
+		unsigned long long start, elapsed;
+		struct pi_pci_info info;
+		struct pi_wait_frames wf;
+		struct pi_userptr xfer;
+		struct pi_irqs irqs;
+		struct pi_dma_node *nodes;
+		unsigned short *frame;
+		double cpu;
+		int fd, opt;
+
+		while ((opt = getopt( argc, argv, "d:k:n:" )) != -1)
+		{
+			switch (opt)
+			{
+				case 'd':
+					device = optarg;
+					break;
+				case 'k':
+					frame_kb = strtoul( optarg, NULL, 0 );
+					break;
+				case 'n':
+					frames = strtoul( optarg, NULL, 0 );
+					break;
+				default:
+					fprintf( stderr, "Usage: %s [-d device] [-k frame KB (SIM_FRAME_KB)] [-n frames]\n",
+						 argv[0] );
+					return 2;
+			}
+		}
+		frame_size = frame_kb * 1024;
+
+		fd = open( device, O_RDWR );
+		if (fd < 0)
+		{
+			perror( device );
+			return 1;
+		}
+		if (ioctl( fd, IOCTL_PCI_GET_PI_INFO, &info ) < 0)
+		{
+			perror( "IOCTL_PCI_GET_PI_INFO" );
+			return 1;
+		}
+
+		/* stopped, the buffer described and the counters cleared */
+		write_ctrl( fd, info.base_address2, 0 );
+		memset( &dma, 0, sizeof(dma) );
+		if (ioctl( fd, IOCTL_PCI_ALLOCATE_SG_TABLE, &dma ) < 0)
+		{
+			perror( "IOCTL_PCI_ALLOCATE_SG_TABLE" );
+			return 1;
+		}
+		if (dma.size < frame_size)
+		{
+			fprintf( stderr, "Buffer of %lu bytes, smaller than a frame\n", dma.size );
+			return 1;
+		}
+
+		nodes = calloc( dma.numberofentries + 1, sizeof(struct pi_dma_node) );
+		frame = malloc( frame_size );
+		max_latencies = frames + PI_EVENT_RING;
+		latencies = calloc( max_latencies, sizeof(unsigned long long) );
+		if (nodes == NULL || frame == NULL || latencies == NULL)
+		{
+			fprintf( stderr, "Out of memory\n" );
+			return 1;
+		}
+
+		printf( "%s: %lu blocks, %lu bytes, frames of %lu KB\n",
+			device, dma.numberofentries, dma.size, frame_kb );
+
+		/* the simulated board starts writing at the beginning of the buffer */
+		if (write_ctrl( fd, info.base_address2, IRQ_EN | RCV_CLR ) < 0)
+		{
+			perror( "IOCTL_PCI_WRITE_DWORD" );
+			return 1;
+		}
+		start = now_ns();
+		cpu = cpu_seconds();
+		wf.since = 0;
+		while (done < frames)
+		{
+			wf.frames = 1;
+			wf.timeout = 1000;
+			if (ioctl( fd, IOCTL_PCI_WAIT_FRAMES, &wf ) < 0)
+			{
+				perror( "IOCTL_PCI_WAIT_FRAMES" );
+				break;
+			}
+			wf.since = wf.nframe_count;
+			read_latencies( fd, now_ns() );
+			ioctl( fd, IOCTL_PCI_GET_IRQS, &irqs );
+
+			/* the frames the board wrote over before they were copied are skipped */
+			while (irqs.eofs - done > dma.size / frame_size && done < frames)
+			{
+				frame_nodes( nodes, frame_size, &block, &offset );
+				done++;
+				skipped++;
+			}
+			for (; done < irqs.eofs && done < frames; done++)
+			{
+				frame_nodes( nodes, frame_size, &block, &offset );
+				memset( &xfer, 0, sizeof(xfer) );
+				xfer.address = frame;
+				xfer.size = frame_size;
+				xfer.xfernodes = (struct pi_dma_frames *)nodes;
+				if (ioctl( fd, IOCTL_PCI_TRANSFER_DATA, &xfer ) < 0)
+				{
+					perror( "IOCTL_PCI_TRANSFER_DATA" );
+					done = frames;
+					break;
+				}
+				/* pixel n of a frame is its number + n */
+				if ((unsigned short)(frame[frame_size / 2 - 1] - frame[0]) !=
+				    (unsigned short)(frame_size / 2 - 1))
+					bad++;
+			}
+		}
+		elapsed = now_ns() - start;
+		cpu = cpu_seconds() - cpu;
+		write_ctrl( fd, info.base_address2, 0 );
+		close( fd );
+
+		printf( "%lu frames in %.3f s: %.1f frames/s, %.1f MB/s copied\n",
+			done, elapsed / 1e9, done * 1e9 / elapsed,
+			(done - skipped) * (double)frame_size * 1e3 / elapsed );
+		printf( "CPU: %.1f us per frame\n", done ? cpu * 1e6 / done : 0 );
+		printf( "Skipped (overwritten): %lu, bad data: %lu\n", skipped, bad );
+		if (nlatencies > 0)
+		{
+			qsort( latencies, nlatencies, sizeof(unsigned long long), compare );
+			printf( "Latency EOF to application (us): min %.1f, median %.1f, p99 %.1f, max %.1f\n",
+				latencies[0] / 1e3, latencies[nlatencies / 2] / 1e3,
+				latencies[nlatencies * 99 / 100] / 1e3, latencies[nlatencies - 1] / 1e3 );
+		}
+		return 0;
+	}
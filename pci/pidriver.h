@@ -42,10 +42,35 @@
 		struct pi_dma_frames *next;
 	};
 	
+	#define PI_USERDMA_NODES	1024
+	
+	/* Only for buffers of at most PI_USERDMA_NODES blocks, see pi_buffer_info */
 	struct pi_userdma_info {
 		DWORD numberofentries;
 		DWORD size;
-		struct pi_dma_node nodes[1024];
+		struct pi_dma_node nodes[PI_USERDMA_NODES];
+	};
+	
+	/* (Re)allocation of the DMA buffer, of any size */
+	struct pi_buffer_info {
+		DWORD size;			/* bytes */
+		DWORD numberofentries;		/* out: number of blocks */
+	};
+	
+	/* Application buffer used for the DMA, instead of the driver's one */
+	struct pi_userbuf {
+		void *address;			/* page aligned, NULL to release it */
+		DWORD size;			/* bytes, a multiple of the page size */
+		DWORD numberofentries;		/* out: number of blocks */
+	};
+	
+	/* Readout of a part of the blocks of the DMA buffer */
+	struct pi_dma_nodes {
+		DWORD first;			/* first block wanted */
+		DWORD count;			/* room in nodes */
+		struct pi_dma_node *nodes;
+		DWORD returned;			/* out: blocks copied in nodes */
+		DWORD numberofentries;		/* out: number of blocks of the buffer */
 	};
 	
 	struct pi_userptr {
@@ -58,6 +83,21 @@
 		DWORD sizeofnodes;
 	};
 
+	/*
+	 * Copy of a rectangle of a frame (see IOCTL_PCI_TRANSFER_ROI): rows of
+	 * row_bytes, stride bytes apart, from offset in the frame. The frames of
+	 * frame_size bytes follow each other from the beginning of the buffer.
+	 */
+	struct pi_roi_transfer {
+		void *address;			/* rows * row_bytes bytes */
+		DWORD frame_size;
+		DWORD frame;			/* frame number, modulo the frames in the buffer */
+		DWORD offset;			/* of the first row in the frame */
+		DWORD stride;
+		DWORD row_bytes;
+		DWORD rows;
+	};
+
 	struct pi_irqs {
 		DWORD triggers;
 		DWORD eofs;
@@ -69,21 +109,145 @@
 		DWORD violations;
 		DWORD fifo_full;
 	};
+	/* Events acknowledged by the interrupt handler, not yet counted in pi_irqs */
+	struct pi_irq_pending {
+		DWORD triggers;
+		DWORD eofs;
+		DWORD bofs;
+		DWORD dma_tc;
+		DWORD violations;
+		DWORD fifo_full;
+	};
+
+	/* One event noted by the interrupt handler, see IOCTL_PCI_READ_EVENTS */
+	struct pi_event {
+		unsigned long long timestamp;	/* ns, CLOCK_MONOTONIC, when the handler saw it */
+		DWORD frame;			/* nframe_count with this event */
+		unsigned short type;		/* PI_EVENT_* */
+	};
+	
+	#define PI_EVENT_TRIGGER	0
+	#define PI_EVENT_BOF		1
+	#define PI_EVENT_EOF		2
+	#define PI_EVENT_DMA_TC		3
+	#define PI_EVENT_VIOLATION	4
+	#define PI_EVENT_FIFO_FULL	5
+	#define PI_EVENT_RECOVERY	6	/* RECOVER: FIFO and receiver reset, the frame is bad */
+	#define PI_EVENT_TYPES		7
+	
+	#define PI_EVENT_RING		1024	/* events kept per card, a power of 2 */
+	
+	/* Readout of the events noted since the last one */
+	struct pi_events {
+		struct pi_event *events;
+		DWORD count;			/* room in events */
+		DWORD returned;			/* out: events copied, oldest first */
+		DWORD lost;			/* out: events dropped so far, the ring being full */
+	};
+
+	/* Eventfd signaled by the interrupt handler for a type of event */
+	struct pi_eventfd {
+		DWORD type;			/* PI_EVENT_* */
+		int fd;				/* eventfd, -1 to stop */
+	};
+	
+	#define PI_HIST_BUCKETS		16
+	
+	/*
+	 * Counters of a board since it was found, never cleared (see IOCTL_PCI_GET_STATS).
+	 * Histogram bucket 0 counts the durations under 1 us, bucket n those from
+	 * 2^(n-1) to 2^n us, the last bucket the longer ones.
+	 */
+	struct pi_stats {
+		unsigned long long interrupts;			/* raised by the board */
+		unsigned long long not_ours;			/* on the shared line, from another device */
+		unsigned long long events[PI_EVENT_TYPES];	/* by PI_EVENT_* */
+		unsigned long long events_lost;			/* not noted, the event ring being full */
+		unsigned long long irq_duration[PI_HIST_BUCKETS];	/* in the interrupt handler */
+		unsigned long long eof_interval[PI_HIST_BUCKETS];	/* between two end of frames */
+	};
+
+	#ifdef __KERNEL__
+	struct pi_sim;
+
 	struct extension {
 		struct mutex mutex; /* acquire it before accessing the device */
+		struct pci_dev *pdev;		/* NULL for the simulated board */
+		struct device *dmadev;		/* the DMA buffer is allocated for it */
+		struct pi_sim *sim;		/* only for the simulated board */
+		struct cdev cdev;
+		struct inode *inode;		/* of the device file, all the mappings are in it */
+		struct kref kref;
+		int minor;
+		int present;		/* the board is still there */
 
 		unsigned long base_address0;
 		unsigned long base_address1;
 		unsigned long base_address2;
+		void __iomem *regs[3];		/* the mappings of the 3 base addresses */
+		unsigned long reg_len[3];	/* their sizes */
 		unsigned int irq;		
 		unsigned char state;
 		
 		/* Dma Buffer Information */
-		struct pi_userdma_info dmainfo;	
+		struct pi_dma_node *nodes;	/* the blocks */
+		unsigned long *block_start;	/* their positions in the buffer, then its size */
+		struct page **user_pages;	/* application buffer used instead, pinned */
+		unsigned long user_npages;
+		struct sg_table user_sgt;
+		int user_mapped;		/* user_sgt is mapped for the DMA */
+		DWORD numberofentries;
+		DWORD buffer_size;
+		atomic_t mmaps;			/* mappings of the buffer */
 		unsigned int bufferflag;
 		struct pi_irqs irqs;
 		unsigned int mem_mapped;
+		spinlock_t irq_lock;		/* protects irqs and pending */
+		struct pi_irq_pending pending;
+
+		struct pi_status *status;	/* the page mmap()ed at PI_MMAP_STATUS_PGOFF */
+		wait_queue_head_t frame_wait;	/* woken up when frames are counted */
+		DWORD poll_seen;		/* nframe_count last returned to the user */
+
+		/* Event ring: written by the interrupt handler, read by IOCTL_PCI_READ_EVENTS */
+		struct pi_event *events;
+		unsigned int event_head;	/* next event written */
+		unsigned int event_tail;	/* next event read */
+		DWORD events_lost;
+		DWORD violation_run;		/* violations since the last clean end of frame (RECOVER) */
+
+		struct eventfd_ctx *eventfds[PI_EVENT_TYPES];	/* protected by irq_lock */
+
+		seqlock_t stats_lock;		/* written by the interrupt handler only */
+		struct pi_stats stats;
+		ktime_t last_eof;
+		struct dentry *debugfs;
+	};
+	
+	/*
+	 * Simulated board (SIMULATE module parameter): a model of the AMCC and TAXI
+	 * registers used by the driver, and frames "received" at a fixed rate while
+	 * IRQ_EN is set in its control register.
+	 */
+	#define PI_SIM_REGS		16	/* 32 bits registers per base address */
+	
+	struct pi_sim {
+		struct extension *devicex;
+		struct platform_device *pdev;	/* device for the DMA buffer */
+		spinlock_t lock;		/* protects the registers */
+		unsigned int regs[3][PI_SIM_REGS];	/* the registers without side effects */
+		unsigned int intcr;		/* AMCC interrupt status (high half) */
+		unsigned int irq_status;	/* TAXI IRQ_RD_PCI */
+		unsigned int rid;		/* TAXI RID_RD_PCI, until read */
+		unsigned int ctrl;		/* TAXI CTRL_WR_PCI */
+		struct hrtimer timer;		/* frame rate */
+		struct work_struct work;	/* writes a frame and raises the interrupt */
+		DWORD node;			/* where the next frame is written */
+		DWORD offset;
+		DWORD frame;
+		DWORD missed;			/* frames not written, the previous one being late */
 	};
+	#endif /* __KERNEL__ */
 	
 	struct pi_pci_info {
 	
@@ -94,6 +258,14 @@
 		unsigned short number_of_cards;	
 	};
 	
+	/* Wait until nframe_count has advanced by frames since the value since */
+	struct pi_wait_frames {
+		DWORD since;
+		DWORD frames;
+		DWORD timeout;		/* in ms, 0 to wait forever */
+		DWORD nframe_count;	/* out: the current nframe_count */
+	};
+	
 	struct pi_pci_io {
 		unsigned long port;
 		union {
@@ -105,6 +277,59 @@
 	
 	
 	
+	/* One register access of IOCTL_PCI_REG_BATCH */
+	struct pi_reg_op {
+		unsigned long port;
+		DWORD value;			/* written, or read back (out) */
+		DWORD mask;			/* bits modified by PI_REG_RMW, or tested by PI_REG_POLL */
+		unsigned short op;		/* PI_REG_* */
+		unsigned short width;		/* 1, 2 or 4 bytes */
+		DWORD delay_us;			/* PI_REG_DELAY duration, PI_REG_POLL timeout, at most PI_REG_DELAY_MAX */
+	};
+	
+	#define PI_REG_READ		0	/* value = register */
+	#define PI_REG_WRITE	1	/* register = value */
+	#define PI_REG_RMW		2	/* register = (register & ~mask) | (value & mask) */
+	#define PI_REG_POLL		3	/* wait until (register & mask) == (value & mask) */
+	#define PI_REG_DELAY	4	/* wait delay_us */
+	
+	#define PI_REG_BATCH_MAX	256
+	#define PI_REG_DELAY_MAX	1000000	/* us */
+	
+	struct pi_reg_batch {
+		struct pi_reg_op *ops;
+		DWORD count;			/* at most PI_REG_BATCH_MAX */
+		DWORD done;			/* out: operations completed */
+	};
+	
+	/*
+	 * Live counters (those of pi_irqs), in a read-only page mmap()ed at the offset
+	 * PI_MMAP_STATUS_PGOFF: seq is odd while they are updated, they are consistent
+	 * if seq was even and the same before and after reading them.
+	 */
+	struct pi_status {
+		unsigned int seq;
+		unsigned int reserved;
+		unsigned long long triggers;
+		unsigned long long eofs;
+		unsigned long long bofs;
+		unsigned long long interrupt_counter;
+		unsigned long long avail;
+		unsigned long long nframe_count;
+		unsigned long long error_occurred;
+		unsigned long long violations;
+		unsigned long long fifo_full;
+		unsigned long long last_block;	/* block of the last DMA terminal count, one per block */
+	};
+	
+	#define PI_MMAP_STATUS_PGOFF	0x0ffff000UL
+	
+	/*
+	 * mmap() offset (in pages) of the registers of a base address, when the
+	 * REG_MMAP parameter allows it. Only for memory mapped boards.
+	 */
+	#define PI_MMAP_REGS_PGOFF(bar)	(0x10000000UL + (bar) * 0x1000UL)
+	
 	#define STATE_CLOSED 0
 	#define STATE_OPEN 	 1
 	
@@ -127,6 +352,31 @@
 	#define IOCTL_PCI_TRANSFER_DATA     _IOWR(MAJOR_NUM, 9, int)
 	#define IOCTL_PCI_GET_IRQS          _IOWR(MAJOR_NUM, 10, int)
 	
+	/* Block until frames are received (see pi_wait_frames) */
+	#define IOCTL_PCI_WAIT_FRAMES       _IOWR(MAJOR_NUM, 11, int)
+	
+	/* Run a sequence of register accesses (see pi_reg_batch) */
+	#define IOCTL_PCI_REG_BATCH         _IOWR(MAJOR_NUM, 12, int)
+	
+	/* DMA buffers of any size (see pi_buffer_info and pi_dma_nodes) */
+	#define IOCTL_PCI_ALLOCATE_BUFFER   _IOWR(MAJOR_NUM, 13, int)
+	#define IOCTL_PCI_GET_NODES         _IOWR(MAJOR_NUM, 14, int)
+	
+	/* Timestamped interrupt events (see pi_events) */
+	#define IOCTL_PCI_READ_EVENTS       _IOWR(MAJOR_NUM, 15, int)
+	
+	/* Counters and histograms since the board was found (see pi_stats) */
+	#define IOCTL_PCI_GET_STATS         _IOWR(MAJOR_NUM, 16, int)
+	
+	/* Copy of a part of a frame (see pi_roi_transfer) */
+	#define IOCTL_PCI_TRANSFER_ROI      _IOWR(MAJOR_NUM, 17, int)
+	
+	/* DMA straight into an application buffer (see pi_userbuf) */
+	#define IOCTL_PCI_MAP_USERPTR       _IOWR(MAJOR_NUM, 18, int)
+	
+	/* Notification of the interrupt events by eventfd (see pi_eventfd) */
+	#define IOCTL_PCI_SET_EVENTFD       _IOWR(MAJOR_NUM, 19, int)
+	
 
 	
 	
@@ -48,8 +48,23 @@
 	#include <linux/pci.h>
 	#include <linux/poll.h>
 	#include <linux/fs.h>
+	#include <linux/cdev.h>
+	#include <linux/kref.h>
   	#include <linux/interrupt.h>
 	#include <linux/sched.h>
+	#include <linux/mm.h>
+	#include <linux/version.h>
+	#include <linux/slab.h>
+	#include <linux/delay.h>
+	#include <linux/seqlock.h>
+	#include <linux/debugfs.h>
+	#include <linux/jump_label.h>
+	#include <linux/seq_file.h>
+	#include <linux/hrtimer.h>
+	#include <linux/workqueue.h>
+	#include <linux/platform_device.h>
+	#include <linux/scatterlist.h>
+	#include <linux/eventfd.h>
 	#include <asm/io.h>
 	#include <asm/uaccess.h>
 	#include "pidriver.h"
@@ -62,15 +77,24 @@
 	#endif
 
 
-	/* Global Structure Holds State of Card for all devices */
-	static struct extension device[PI_MAX_CARDS];
+	/* The cards found, indexed by their minor number */
+	static struct extension *cards[PI_MAX_CARDS];
 	static int cards_found = 0;
+	static DEFINE_MUTEX(cards_mutex);	/* protects cards and cards_found */
+	static struct class *princeton_class;
+	static struct dentry *princeton_debugfs;	/* pipci/ in debugfs */
 	
 	int DMA_MB      =8;
 	int IMAGE_ORDER	=2;       /* get 4 pages per block*/
 	int IMAGE_PAGES	=4;       /* 2 ^ IMAGE_ORDER	  */
 	int IRQ         = 99;   /* we won't be using 99, just a placeholder for now */
 	int SHARE       = 1;
+	int DMA_BITS    = 32;     /* the AMCC S5933 bus master only drives 32 bits addresses */
+	int REG_MMAP    = 0;
+	int MAX_BLOCK_ORDER = 0;  /* 0: all the blocks have IMAGE_PAGES pages */
+	int SIMULATE    = 0;      /* frames per second of the simulated board, 0 for the real ones */
+	int SIM_FRAME_KB = 1024;
+	int RECOVER     = 0;
 	#define BYTES_MB 1048576
 		
 	MODULE_AUTHOR("Princeton Instruments");
@@ -81,11 +105,23 @@
 	module_param( IMAGE_PAGES, int, 0 );
 	module_param( IRQ, int, 0 );
 	module_param( SHARE, int, 0 );
-	MODULE_PARM_DESC( DMA_MB, "Memory Buffer Size (MB)");
+	module_param( DMA_BITS, int, 0 );
+	module_param( REG_MMAP, int, 0 );
+	module_param( MAX_BLOCK_ORDER, int, 0 );
+	module_param( SIMULATE, int, 0 );
+	module_param( SIM_FRAME_KB, int, 0 );
+	module_param( RECOVER, int, 0 );
+	MODULE_PARM_DESC( DMA_MB, "Memory Buffer Size (MB), allocated at the first open");
 	MODULE_PARM_DESC( IMAGE_ORDER, "2 ^ IMAGE_ORDER = IMAGE_PAGES");
 	MODULE_PARM_DESC( IMAGE_PAGES, "IMAGE_PAGES = 2 ^ IMAGE_ORDER");
 	MODULE_PARM_DESC( IRQ,"Specify IRQ to use for pipci");
 	MODULE_PARM_DESC( SHARE,"1 Enables Irq Sharing, 0 Disables Irq Sharing" );
+	MODULE_PARM_DESC( DMA_BITS,"Address bits the board can use for DMA: 32 (default), 64 only for boards with a 64 bits bus master" );
+	MODULE_PARM_DESC( REG_MMAP,"Registers mmap() for CAP_SYS_RAWIO: 0 Disabled, 1 Read-only, 2 Read-write" );
+	MODULE_PARM_DESC( MAX_BLOCK_ORDER,"If above IMAGE_ORDER, DMA blocks of 2 ^ MAX_BLOCK_ORDER pages, or less if memory is short");
+	MODULE_PARM_DESC( SIMULATE,"Frames per second of a simulated board, instead of the PCI ones (0)" );
+	MODULE_PARM_DESC( SIM_FRAME_KB,"Frame size of the simulated board (KB)" );
+	MODULE_PARM_DESC( RECOVER,"1 Resets the FIFO and receiver and goes on after a FIFO full or too many violations, 0 Stops" );
 
 	MODULE_LICENSE( "GPL v2" );
 
@@ -108,6 +144,10 @@
 	static long 	princeton_ioctl( struct file *fp, unsigned int ioctl_command,
 					 unsigned long ioctl_param);							 			
 
+	static int  	princeton_mmap( struct file *fp, struct vm_area_struct *vma );
+
+	static __poll_t	princeton_poll( struct file *fp, poll_table *wait );
+
  	static struct file_operations functions = {
 		.owner   = THIS_MODULE,
 		.read    = princeton_read,
@@ -115,38 +155,208 @@
 		.unlocked_ioctl = princeton_ioctl,
 		.open    = princeton_open,
 		.release = princeton_release,
+		.mmap    = princeton_mmap,
+		.poll    = princeton_poll,
 	};			
 	
+	static int	princeton_probe( struct pci_dev *dev, const struct pci_device_id *id );
+	
+	static void	princeton_remove( struct pci_dev *dev );
+	
+	static const struct pci_device_id princeton_ids[] = {
+		{ PCI_DEVICE( PI_PCI_VENDOR, PI_PCI_DEVICE ) },
+		{ }
+	};
+	MODULE_DEVICE_TABLE( pci, princeton_ids );
+	
+	static struct pci_driver princeton_driver = {
+		.name     = DEVICE_NAME,
+		.id_table = princeton_ids,
+		.probe    = princeton_probe,
+		.remove   = princeton_remove,
+	};
+	
+	static unsigned long princeton_shrink_count( struct shrinker *shrinker, struct shrink_control *sc );
+
+	static unsigned long princeton_shrink_scan( struct shrinker *shrinker, struct shrink_control *sc );
+
+	/* Frees the buffers of the cards not in use when the memory is short */
+	static struct shrinker *princeton_shrinker;
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+	static struct shrinker princeton_shrinker_static = {
+		.count_objects = princeton_shrink_count,
+		.scan_objects  = princeton_shrink_scan,
+		.seeks         = DEFAULT_SEEKS,
+	};
+	#endif
+	
 	/*------------END DRIVER ENTRY POINTS--------------------*/
 	
 	
 	/*------------LOCAL FUNCTION CALLS-----------------------*/
 
-	int  princeton_find_devices(void);
+	void princeton_delete( struct kref *kref );
 
 	int princeton_output(	void *io_object, struct extension *devicex, unsigned int type);
 
 	int princeton_input( 	void *io_object, struct extension *devicex, unsigned int type);
+
+	int princeton_reg_batch( void *user_object, struct extension *devicex );
 					
 	int princeton_get_info( void *info_object, struct extension *devicex);					
 							
 	int princeton_do_scatter( void *dma_object, struct extension *devicex);
 						  
-	int princeton_do_scatter_boot(  long size, struct extension *devicex);
+	int princeton_alloc_buffer( struct extension *devicex, DWORD size, int partial );
+
+	int princeton_resize_buffer( struct extension *devicex, DWORD size, DWORD max_blocks );
+
+	int princeton_allocate_buffer( void *user_object, struct extension *devicex );
+
+	int princeton_get_nodes( void *user_object, struct extension *devicex );
+
+	int princeton_map_userptr( void *user_object, struct extension *devicex );
+
+	int princeton_set_dma_mask( struct pci_dev *dev );
+
+	int princeton_alloc_block( struct extension *devicex, struct pi_dma_node *node,
+				   unsigned long bytes, gfp_t flags );
+
+	void *princeton_dma_to_virt( struct extension *devicex, dma_addr_t dma, DWORD size,
+				     DWORD *hint );
 	
 	void princeton_release_scatter( struct extension *devicex );
+
+	void princeton_stop_board( struct extension *devicex );
 	
 	int princeton_transfer_to_user( void *user_object, struct extension *devicex );
+
+	int princeton_transfer_roi( void *user_object, struct extension *devicex );
 	
-	irqreturn_t princeton_handle_irq(int irq, void *devicex);
+	irqreturn_t princeton_handle_irq_pio(int irq, void *devicex);
+
+	irqreturn_t princeton_handle_irq_mmio(int irq, void *devicex);
+
+	irqreturn_t princeton_handle_irq_sim(int irq, void *devicex);
+	
+	irqreturn_t princeton_irq_thread(int irq, void *devicex);
 	
 	int princeton_get_irqs( void *user_object, struct extension *devicex );
 	
+	int princeton_wait_frames( void *user_object, struct extension *devicex );
+	
 	int princeton_clear_counters( struct extension *devicex );
 
+	int princeton_read_events( void *user_object, struct extension *devicex );
+
+	int princeton_set_eventfd( void *user_object, struct extension *devicex );
+
+	void princeton_clear_eventfds( struct extension *devicex );
+
+	void princeton_get_stats( struct extension *devicex, struct pi_stats *stats );
+
+	int princeton_stats_show( struct seq_file *m, void *v );
+
+	DWORD princeton_sim_read( struct extension *devicex, void __iomem *addr );
+
+	void princeton_sim_write( struct extension *devicex, void __iomem *addr, DWORD value );
+
+	int princeton_sim_start( void );
+
+	void princeton_sim_stop( void );
+
 	/*------------END LOCAL FUNCTION CALLS-------------------*/
+
+	DEFINE_SHOW_ATTRIBUTE( princeton_stats );
+	
+	/*
+	 * Returns the mapping of the width bytes at port (a base address returned by
+	 * IOCTL_PCI_GET_PI_INFO plus an offset), or NULL if they are not registers
+	 * of the board.
+	 */
+	static void __iomem *princeton_reg_addr( struct extension *devicex, unsigned long port,
+						 unsigned int width )
+	{
+		unsigned long base[3];
+		int bar;
+		
+		base[0] = devicex->base_address0;
+		base[1] = devicex->base_address1;
+		base[2] = devicex->base_address2;
+		for (bar = 0; bar < 3; bar++)
+		{
+			if (devicex->regs[bar] == NULL || port < base[bar])
+				continue;
+			if (port - base[bar] + width <= devicex->reg_len[bar])
+				return devicex->regs[bar] + (port - base[bar]);
+		}
+		return NULL;
+	}
+	
+	/* Only enabled if a simulated board is created, the others don't test devicex->sim */
+	static DEFINE_STATIC_KEY_FALSE( princeton_sim_key );
+
+	/*
+	 * Register accesses, the same for the I/O ports and the memory mapped registers.
+	 * The simulated board only has 32 bits registers.
+	 */
+	static inline DWORD princeton_reg_read( struct extension *devicex, void __iomem *addr,
+						unsigned int width )
+	{
+		if (static_branch_unlikely( &princeton_sim_key ) && devicex->sim)
+			return princeton_sim_read( devicex, addr );
+		switch (width)
+		{
+			case 1:
+				return ioread8( addr );
+			case 2:
+				return ioread16( addr );
+			default:
+				return ioread32( addr );
+		}
+	}
+	
+	static inline void princeton_reg_write( struct extension *devicex, void __iomem *addr,
+						unsigned int width, DWORD value )
+	{
+		if (static_branch_unlikely( &princeton_sim_key ) && devicex->sim)
+		{
+			princeton_sim_write( devicex, addr, value );
+			return;
+		}
+		switch (width)
+		{
+			case 1:
+				iowrite8( value, addr );
+				break;
+			case 2:
+				iowrite16( value, addr );
+				break;
+			default:
+				iowrite32( value, addr );
+		}
+	}
 	
-	static struct pi_dma_node *dmanodeshead;
+	/* The DMA handle of a block, passed to the user in the physaddr pointer */
+	static inline dma_addr_t pi_node_dma( const struct pi_dma_node *node )
+	{
+		return (dma_addr_t)(unsigned long)node->physaddr;
+	}
+
+	/* Whether the size of the blocks adapts to the memory available */
+	static inline int princeton_adaptive_blocks( void )
+	{
+		return MAX_BLOCK_ORDER > IMAGE_ORDER;
+	}
+
+	/* Size allocated for a block, the used size (physsize) rounded up */
+	static inline unsigned long princeton_block_bytes( const struct pi_dma_node *node )
+	{
+		if ( !princeton_adaptive_blocks() )
+			return PAGE_SIZE * IMAGE_PAGES;
+		return PAGE_SIZE << max( get_order( node->physsize ), IMAGE_ORDER );
+	}
+
 	/******************************************************************************
 	*
 	*
@@ -157,27 +367,61 @@
 	static int initialize(void)
 	{
 		int err;
-		int devices;
 		
-		// TODO: use, newer, cdev interface
-		err = register_chrdev(MAJOR_NUM, DEVICE_NAME, &functions );
+		err = register_chrdev_region( MKDEV(MAJOR_NUM, 0), PI_MAX_CARDS, DEVICE_NAME );
 		if ( err < 0 ) {
 			printk( KERN_INFO "Failed To Register Character Driver\n");
 			return err;
 		} 
-		else
-			printk( KERN_INFO "Registered Character Driver %i\n", err);
 
-		printk(KERN_INFO "Searching For Princeton Card\n");
-		devices = princeton_find_devices();
-		if (devices == 0)
-			return -ENODEV;
-			
-		printk(KERN_INFO "Found %i cards\n", devices);
-		dmanodeshead = (struct pi_dma_node*)(__get_free_pages(GFP_KERNEL, 1));
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+		princeton_class = class_create( DEVICE_NAME );
+	#else
+		princeton_class = class_create( THIS_MODULE, DEVICE_NAME );
+	#endif
+		if ( IS_ERR(princeton_class) ) {
+			unregister_chrdev_region( MKDEV(MAJOR_NUM, 0), PI_MAX_CARDS );
+			return PTR_ERR(princeton_class);
+		}
+
+		/* no debugfs (error or disabled) only means no statistics there */
+		princeton_debugfs = debugfs_create_dir( DEVICE_NAME, NULL );
+
+		if ( SIMULATE > 0 ) {
+			printk(KERN_INFO "Simulating a card\n");
+			err = princeton_sim_start();
+		} else {
+			printk(KERN_INFO "Searching For Princeton Card\n");
+			err = pci_register_driver( &princeton_driver );
+		}
+		if ( err < 0 ) {
+			debugfs_remove_recursive( princeton_debugfs );
+			class_destroy( princeton_class );
+			unregister_chrdev_region( MKDEV(MAJOR_NUM, 0), PI_MAX_CARDS );
+			return err;
+		}
+
+		/* not fatal, the buffers are then only freed with the cards */
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+		princeton_shrinker = shrinker_alloc( 0, DEVICE_NAME );
+		if ( princeton_shrinker ) {
+			princeton_shrinker->count_objects = princeton_shrink_count;
+			princeton_shrinker->scan_objects = princeton_shrink_scan;
+			shrinker_register( princeton_shrinker );
+		}
+	#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+		if ( register_shrinker( &princeton_shrinker_static, DEVICE_NAME ) == 0 )
+			princeton_shrinker = &princeton_shrinker_static;
+	#else
+		if ( register_shrinker( &princeton_shrinker_static ) == 0 )
+			princeton_shrinker = &princeton_shrinker_static;
+	#endif
+		if ( princeton_shrinker == NULL )
+			printk(KERN_INFO "Failed to register the shrinker\n");
 		return 0;
 	}
 	
+
 	/******************************************************************************
 	*
 	*
@@ -187,23 +431,107 @@
 	******************************************************************************/
 	static void cleanup(void)
 	{
-		int i;
+		if ( princeton_shrinker ) {
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+			shrinker_free( princeton_shrinker );
+	#else
+			unregister_shrinker( princeton_shrinker );
+	#endif
+		}
+		if ( SIMULATE > 0 )
+			princeton_sim_stop();
+		else
+			pci_unregister_driver( &princeton_driver );
+		debugfs_remove_recursive( princeton_debugfs );
+		class_destroy( princeton_class );
+		unregister_chrdev_region( MKDEV(MAJOR_NUM, 0), PI_MAX_CARDS );
+	}
+	
 
-		if ( cards_found > 0 )
-			for ( i=0; i<cards_found; i++ )
-			{
-				free_irq(device[i].irq, ( struct extension *)&device[i]);
-				princeton_release_scatter( &device[i]);
-			}
+	/******************************************************************************
+	*
+	*
+	*
+	*
+	*
+	******************************************************************************/
+	static struct extension *princeton_new_card( void )
+	{
+		struct extension *devicex;
+		int card;
+		
+		mutex_lock( &cards_mutex );
+		for ( card = 0; card < PI_MAX_CARDS && cards[card]; card++ )
+			;
+		if ( card == PI_MAX_CARDS ) {
+			mutex_unlock( &cards_mutex );
+			printk(KERN_INFO "Too many cards\n");
+			return ERR_PTR(-ENODEV);
+		}
+		devicex = kzalloc( sizeof(struct extension), GFP_KERNEL );
+		if ( devicex == NULL ) {
+			mutex_unlock( &cards_mutex );
+			return ERR_PTR(-ENOMEM);
+		}
+		cards[card] = devicex;
+		cards_found++;
+		mutex_unlock( &cards_mutex );
 
-		if ( dmanodeshead )
-			free_pages((int)dmanodeshead, 1);						
-		else
-			printk(KERN_INFO "No DMA nodes\n");
+		devicex->minor = card;
+		kref_init( &devicex->kref );
+		mutex_init( &devicex->mutex );
+		init_waitqueue_head( &devicex->frame_wait );
+		spin_lock_init( &devicex->irq_lock );
+		seqlock_init( &devicex->stats_lock );
 
-		unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+		devicex->events = kcalloc( PI_EVENT_RING, sizeof(struct pi_event), GFP_KERNEL );
+		devicex->status = (struct pi_status *)get_zeroed_page( GFP_KERNEL );
+		if ( devicex->events == NULL || devicex->status == NULL ) {
+			kref_put( &devicex->kref, princeton_delete );
+			return ERR_PTR(-ENOMEM);
+		}
+		return devicex;
 	}
-	
+
+	/******************************************************************************
+	*
+	*	Makes a card ready for use: creates its device file.
+	*
+	******************************************************************************/
+	static int princeton_add_card( struct extension *devicex, struct device *parent )
+	{
+		int err;
+
+		devicex->present = 1;
+		cdev_init( &devicex->cdev, &functions );
+		devicex->cdev.owner = THIS_MODULE;
+		err = cdev_add( &devicex->cdev, MKDEV(MAJOR_NUM, devicex->minor), 1 );
+		if ( err < 0 ) {
+			devicex->present = 0;
+			return err;
+		}
+		device_create( princeton_class, parent, MKDEV(MAJOR_NUM, devicex->minor), devicex,
+			       DEVICE_FILE_NAME "%d", devicex->minor );
+		if ( !IS_ERR_OR_NULL( princeton_debugfs ) ) {
+			char name[16];
+
+			snprintf( name, sizeof(name), DEVICE_FILE_NAME "%d", devicex->minor );
+			devicex->debugfs = debugfs_create_file( name, 0444, princeton_debugfs, devicex,
+								&princeton_stats_fops );
+		}
+
+		printk(KERN_INFO "Card %i ready\n", devicex->minor);
+		return 0;
+	}
+
+	/* Removes the device file of a card, the open files fail from now on */
+	static void princeton_del_card( struct extension *devicex )
+	{
+		debugfs_remove( devicex->debugfs );
+		device_destroy( princeton_class, MKDEV(MAJOR_NUM, devicex->minor) );
+		cdev_del( &devicex->cdev );
+	}
+
 	/******************************************************************************
 	*
 	*
@@ -211,59 +539,209 @@
 	*
 	*
 	******************************************************************************/
-	int princeton_find_devices(void)
+	static int princeton_probe( struct pci_dev *dev, const struct pci_device_id *id )
 	{				
-		int status = 0;
-		struct pci_dev *dev = NULL;
+		struct extension *devicex;
+		int err, bar;
 		unsigned short command;	
 		unsigned long flags;	
 		
-		while ((dev = pci_get_device(PI_PCI_VENDOR, PI_PCI_DEVICE, dev)))
-		{
+		devicex = princeton_new_card();
+		if ( IS_ERR(devicex) )
+			return PTR_ERR(devicex);
+		devicex->pdev = pci_dev_get( dev );
+		devicex->dmadev = &dev->dev;
+		pci_set_drvdata( dev, devicex );
+
+		err = pci_enable_device( dev );
+		if ( err < 0 )
+			goto error;
            	
-			pci_read_config_word( dev, PCI_COMMAND, &command );
-			pci_read_config_word( dev, PCI_BASE_ADDRESS_0, (unsigned short *)&device[cards_found].base_address0 );
-			pci_read_config_word( dev, PCI_BASE_ADDRESS_1, (unsigned short *)&device[cards_found].base_address1 );
-			pci_read_config_word( dev, PCI_BASE_ADDRESS_2, (unsigned short *)&device[cards_found].base_address2 );
-			if ( device[0].base_address0 & 1 )	
-			{
-			
-				device[cards_found].base_address0 = device[cards_found].base_address0 - 1;
-				device[cards_found].base_address1 = device[cards_found].base_address1 - 1;
-				device[cards_found].base_address2 = device[cards_found].base_address2 - 1;
-				command |= PCI_COMMAND_IO;
-				device[cards_found].mem_mapped = 0;
-			}
-			else
+		pci_read_config_word( dev, PCI_COMMAND, &command );
+		devicex->base_address0 = pci_resource_start( dev, 0 );
+		devicex->base_address1 = pci_resource_start( dev, 1 );
+		devicex->base_address2 = pci_resource_start( dev, 2 );
+		for ( bar = 0; bar < 3; bar++ ) {
+			devicex->regs[bar] = pci_iomap( dev, bar, 0 );
+			devicex->reg_len[bar] = pci_resource_len( dev, bar );
+		}
+		if ( devicex->regs[0] == NULL || devicex->regs[2] == NULL )
+		{
+			printk(KERN_INFO "Failed to map the registers\n");
+			err = -ENOMEM;
+			goto error_disable;
+		}
+
+		if ( pci_resource_flags( dev, 0 ) & IORESOURCE_IO )	
+		{
+			command |= PCI_COMMAND_IO;
+			devicex->mem_mapped = 0;
+		}
+		else
+		{
+			devicex->mem_mapped = 1;
+			command |= PCI_COMMAND_MEMORY;		
+		}
+		if( IRQ != 99 )
+			dev->irq = IRQ;
+		devicex->irq 	= dev->irq;		
+		printk(KERN_INFO "Using IRQ %d\n", dev->irq );
+
+		printk(KERN_INFO "Base Address 0 0x%lx\n",devicex->base_address0 );
+		printk(KERN_INFO "Base Address 1 0x%lx\n",devicex->base_address1 );
+		printk(KERN_INFO "Base Address 2 0x%lx\n",devicex->base_address2 );
+
+		flags = (SHARE) ? IRQF_SHARED : 0;
+		err = request_threaded_irq( dev->irq,
+					    devicex->mem_mapped ? princeton_handle_irq_mmio : princeton_handle_irq_pio,
+					    princeton_irq_thread,
+					    flags, DEVICE_NAME, devicex );
+		if ( err < 0 )
+			goto error_disable;
+		
+		command |= PCI_COMMAND_MASTER;	
+		pci_write_config_word( dev, PCI_COMMAND, command );
+		pci_set_master(dev);
+		if ( princeton_set_dma_mask( dev ) != 0 )
+			printk(KERN_INFO "No suitable DMA mask, the buffer can't be allocated\n");
+
+		err = princeton_add_card( devicex, &dev->dev );
+		if ( err < 0 )
+			goto error_irq;
+		return 0;
+
+	error_irq:
+		free_irq( devicex->irq, devicex );
+	error_disable:
+		for ( bar = 0; bar < 3; bar++ )
+			if ( devicex->regs[bar] )
+				pci_iounmap( dev, devicex->regs[bar] );
+		pci_disable_device( dev );
+	error:
+		kref_put( &devicex->kref, princeton_delete );
+		return err;
+	}
+
+	/******************************************************************************
+	*
+	*	The board is gone: stop using it. The mappings of the applications are
+	*	removed (SIGBUS if they are still used) and the DMA buffer is freed while
+	*	the device can still be used by the DMA API. The rest is freed when the
+	*	device file is not used anymore.
+	*
+	******************************************************************************/
+	static void princeton_remove( struct pci_dev *dev )
+	{
+		struct extension *devicex = pci_get_drvdata( dev );
+		int bar;
+		
+		princeton_del_card( devicex );
+
+		mutex_lock( &devicex->mutex );
+		princeton_stop_board( devicex );
+		devicex->present = 0;
+		if ( devicex->inode )
+			unmap_mapping_range( devicex->inode->i_mapping, 0, 0, 1 );
+		free_irq( devicex->irq, devicex );
+		princeton_release_scatter( devicex );
+		for ( bar = 0; bar < 3; bar++ )
+			if ( devicex->regs[bar] )
+				pci_iounmap( dev, devicex->regs[bar] );
+		pci_disable_device( dev );
+		mutex_unlock( &devicex->mutex );
+
+		wake_up_interruptible( &devicex->frame_wait );
+		kref_put( &devicex->kref, princeton_delete );
+	}
+
+	/******************************************************************************
+	*
+	*	Frees a card, once it's been removed and closed
+	*
+	******************************************************************************/
+	void princeton_delete( struct kref *kref )
+	{
+		struct extension *devicex = container_of( kref, struct extension, kref );
+
+		/* the shrinker may be freeing it too */
+		mutex_lock( &devicex->mutex );
+		princeton_release_scatter( devicex );
+		mutex_unlock( &devicex->mutex );
+		if ( devicex->sim ) {
+			platform_device_unregister( devicex->sim->pdev );
+			kfree( devicex->sim );
+		}
+		pci_dev_put( devicex->pdev );
+		if ( devicex->inode )
+			iput( devicex->inode );
+
+		mutex_lock( &cards_mutex );
+		cards[devicex->minor] = NULL;
+		cards_found--;
+		mutex_unlock( &cards_mutex );
+		kfree( devicex->events );
+		free_page( (unsigned long)devicex->status );
+		kfree( devicex );
+	}
+
+	/* The buffer of a card can be freed when nobody uses it (the board is stopped at close) */
+	static inline int princeton_buffer_idle( struct extension *devicex )
+	{
+		return devicex->state != STATE_OPEN && atomic_read( &devicex->mmaps ) == 0;
+	}
+
+	/******************************************************************************
+	*
+	*	Memory pressure: counts the pages of the buffers which could be freed.
+	*	It can't wait for the locks, the allocations may be done holding them.
+	*
+	******************************************************************************/
+	static unsigned long princeton_shrink_count( struct shrinker *shrinker, struct shrink_control *sc )
+	{
+		unsigned long pages = 0;
+		int card;
+
+		if ( !mutex_trylock( &cards_mutex ) )
+			return 0;
+		for ( card = 0; card < PI_MAX_CARDS; card++ )
+			if ( cards[card] && princeton_buffer_idle( cards[card] ) )
+				pages += PAGE_ALIGN( READ_ONCE( cards[card]->buffer_size ) ) >> PAGE_SHIFT;
+		mutex_unlock( &cards_mutex );
+		return pages ? pages : SHRINK_EMPTY;
+	}
+
+	/******************************************************************************
+	*
+	*	Memory pressure: frees the buffers of the cards not open nor mmap()ed,
+	*	they are allocated again at the next open.
+	*
+	******************************************************************************/
+	static unsigned long princeton_shrink_scan( struct shrinker *shrinker, struct shrink_control *sc )
+	{
+		struct extension *devicex;
+		unsigned long freed = 0;
+		int card;
+
+		if ( !mutex_trylock( &cards_mutex ) )
+			return SHRINK_STOP;
+		for ( card = 0; card < PI_MAX_CARDS && freed < sc->nr_to_scan; card++ )
+		{
+			devicex = cards[card];
+			if ( devicex == NULL || !mutex_trylock( &devicex->mutex ) )
+				continue;
+			if ( devicex->numberofentries && princeton_buffer_idle( devicex ) )
 			{
-				device[cards_found].mem_mapped = 1;
-				command |= PCI_COMMAND_MEMORY;		
+				freed += PAGE_ALIGN( devicex->buffer_size ) >> PAGE_SHIFT;
+				princeton_release_scatter( devicex );
+				printk(KERN_INFO "Card %i idle, buffer freed\n", card);
 			}
-			if( IRQ != 99 )
-				dev->irq = IRQ;
-			device[cards_found].irq 	= dev->irq;		
-			printk(KERN_INFO "Using IRQ %d\n", dev->irq );
-			device[cards_found].bufferflag	= 0;
-			device[cards_found].dmainfo.numberofentries = 0;
-
-			printk(KERN_INFO "Base Address 0 0x%lx\n",device[0].base_address0 );
-			printk(KERN_INFO "Base Address 1 0x%lx\n",device[0].base_address1 );
-			printk(KERN_INFO "Base Address 2 0x%lx\n",device[0].base_address2 );
-
-			flags = (SHARE) ? IRQF_SHARED : 0;
-			status = request_irq( dev->irq, princeton_handle_irq, flags, DEVICE_NAME, &device[cards_found]); 
-			
-			command |= PCI_COMMAND_MASTER;	
-			pci_write_config_word( dev, PCI_COMMAND, command );
-			pci_set_master(dev);
-			
-			princeton_do_scatter_boot( BYTES_MB*DMA_MB, &device[cards_found] );
-			cards_found++;
-		}			
-		printk(KERN_INFO "Number of Devices Found %i\n", cards_found);
-		return (cards_found);
+			mutex_unlock( &devicex->mutex );
+		}
+		mutex_unlock( &cards_mutex );
+		return freed ? freed : SHRINK_STOP;
 	}
 	
+
 	/******************************************************************************
 	*
 	*	DUMMY FUNCTION:	Normal File Read Access Handler
@@ -301,22 +779,41 @@
 	static int princeton_open(struct inode *inode, 
 						  struct file *fp )
 	{
-		int card;
+		struct extension *devicex;
 		
-		card = inode->i_rdev & 0x0f;
+		devicex = container_of( inode->i_cdev, struct extension, cdev );
 	
-		if ( device[card].state == STATE_OPEN)
+		mutex_lock( &devicex->mutex );
+		if ( !devicex->present ) {
+			mutex_unlock( &devicex->mutex );
+			return -ENODEV;
+		}
+		if ( devicex->state == STATE_OPEN) {
+			mutex_unlock( &devicex->mutex );
 			return -EBUSY;
-			
-		fp->private_data = (void *)(&device[card]);
-		mutex_init(&device[card].mutex);
-		
-		device[card].state = STATE_OPEN;
+		}
+		devicex->state = STATE_OPEN;
+		kref_get( &devicex->kref );
+
+		/* the mappings of all the files in one place, to be removed with the board */
+		if ( devicex->inode == NULL )
+			devicex->inode = igrab( inode );
+		if ( devicex->inode )
+			fp->f_mapping = devicex->inode->i_mapping;
 
+		/* The buffer is kept after close, until the memory runs short */
+		if ( devicex->numberofentries == 0 &&
+		     princeton_alloc_buffer( devicex, BYTES_MB*DMA_MB, 1 ) != PIDD_SUCCESS )
+			printk(KERN_INFO "Card %i: no DMA buffer of %i MB, to be allocated by ioctl\n",
+			       devicex->minor, DMA_MB);
+		mutex_unlock( &devicex->mutex );
+			
+		fp->private_data = (void *)devicex;
 		
 		return PIDD_SUCCESS;
 	}
 	
+
 	/******************************************************************************
 	*
 	*
@@ -327,15 +824,23 @@
 	static int princeton_release(struct inode *inode, 
 							 struct file *fp)
 	{
-		int card;
+		struct extension *devicex = (struct extension *)(fp->private_data);
 
-		card = inode->i_rdev & 0x0f;
-		
-		device[card].state = STATE_CLOSED;
-		
+		mutex_lock( &devicex->mutex );
+		devicex->state = STATE_CLOSED;
+		/* nobody to set it up again: the buffer can then be freed any time */
+		princeton_stop_board( devicex );
+		/* the application buffer and eventfds go with the application */
+		if ( devicex->user_pages )
+			princeton_release_scatter( devicex );
+		princeton_clear_eventfds( devicex );
+		mutex_unlock( &devicex->mutex );
+
+		kref_put( &devicex->kref, princeton_delete );
 		return PIDD_SUCCESS;
 	}
 	
+
 	/******************************************************************************
 	*
 	*
@@ -351,7 +856,16 @@
 		struct extension *devicex;
 		status = PIDD_SUCCESS;						
 		devicex = (struct extension *)(fp->private_data);
+
+		/* It sleeps until the interrupts come, without the mutex */
+		if ( ioctl_command == IOCTL_PCI_WAIT_FRAMES )
+			return princeton_wait_frames((void*)ioctl_param, devicex);
+
 		mutex_lock(&devicex->mutex);
+		if ( !devicex->present ) {
+			mutex_unlock(&devicex->mutex);
+			return -ENODEV;
+		}
 
 		switch ( ioctl_command )
 		{
@@ -362,27 +876,67 @@
 			case IOCTL_PCI_READ_BYTE:
 			case IOCTL_PCI_READ_WORD:
 			case IOCTL_PCI_READ_DWORD:
-				princeton_input((void*)ioctl_param, devicex, ioctl_command);
+				status = princeton_input((void*)ioctl_param, devicex, ioctl_command);
 				break;
 				
 			case IOCTL_PCI_WRITE_BYTE:
 			case IOCTL_PCI_WRITE_WORD:
 			case IOCTL_PCI_WRITE_DWORD:
-				princeton_output((void*)ioctl_param, devicex, ioctl_command);
+				status = princeton_output((void*)ioctl_param, devicex, ioctl_command);
 				break;
 			
 			case IOCTL_PCI_ALLOCATE_SG_TABLE:
 			    princeton_clear_counters( devicex );
-				princeton_do_scatter((void*)ioctl_param, devicex );
+				status = princeton_do_scatter((void*)ioctl_param, devicex );
 				break;
 				
 			case IOCTL_PCI_TRANSFER_DATA:
-				princeton_transfer_to_user((void*)ioctl_param, devicex);
+				status = princeton_transfer_to_user((void*)ioctl_param, devicex);
+				break;
+				
+			case IOCTL_PCI_TRANSFER_ROI:
+				status = princeton_transfer_roi((void*)ioctl_param, devicex);
 				break;
 				
 			case IOCTL_PCI_GET_IRQS:
 				princeton_get_irqs( (void*)ioctl_param, devicex );
 				break;
+				
+			case IOCTL_PCI_REG_BATCH:
+				status = princeton_reg_batch( (void*)ioctl_param, devicex );
+				break;
+				
+			case IOCTL_PCI_ALLOCATE_BUFFER:
+				princeton_clear_counters( devicex );
+				status = princeton_allocate_buffer( (void*)ioctl_param, devicex );
+				break;
+				
+			case IOCTL_PCI_GET_NODES:
+				status = princeton_get_nodes( (void*)ioctl_param, devicex );
+				break;
+				
+			case IOCTL_PCI_MAP_USERPTR:
+				princeton_clear_counters( devicex );
+				status = princeton_map_userptr( (void*)ioctl_param, devicex );
+				break;
+				
+			case IOCTL_PCI_READ_EVENTS:
+				status = princeton_read_events( (void*)ioctl_param, devicex );
+				break;
+				
+			case IOCTL_PCI_SET_EVENTFD:
+				status = princeton_set_eventfd( (void*)ioctl_param, devicex );
+				break;
+				
+			case IOCTL_PCI_GET_STATS:
+				{
+					struct pi_stats stats;
+
+					princeton_get_stats( devicex, &stats );
+					if ( copy_to_user( (void*)ioctl_param, &stats, sizeof(struct pi_stats) ) )
+						status = -EFAULT;
+				}
+				break;
 			default:
 				status = -ENOTTY;
 		}
@@ -391,55 +945,271 @@
 		return status;
 	}
 	
+	/* Read-only mapping, it can't be made writable later either */
+	static int princeton_vma_readonly( struct vm_area_struct *vma )
+	{
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+		vm_flags_clear( vma, VM_MAYWRITE );
+	#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+	#endif
+		return 0;
+	}
+
+	/* Maps the status page (one page, read-only) */
+	static int princeton_mmap_status( struct extension *devicex, struct vm_area_struct *vma )
+	{
+		if (vma_pages( vma ) != 1)
+			return -EINVAL;
+		if (princeton_vma_readonly( vma ) != 0)
+			return -EPERM;
+		return remap_pfn_range( vma, vma->vm_start, virt_to_phys( devicex->status ) >> PAGE_SHIFT,
+					PAGE_SIZE, vma->vm_page_prot );
+	}
+
 	/******************************************************************************
 	*
+	*	Maps the registers of a (memory) base address, so that they can be polled
+	*	without a syscall. Only if allowed by REG_MMAP, and for CAP_SYS_RAWIO.
 	*
-	*
-	*
-	*
-	******************************************************************************/	
-	int princeton_output(	void *io_object, 
-						struct extension *devicex,
-						unsigned int type)
+	******************************************************************************/
+	static int princeton_mmap_regs( struct extension *devicex, struct vm_area_struct *vma )
 	{
-		struct pi_pci_io output;
-		int status = 0;
-		
-		copy_from_user( &output, io_object, sizeof(struct pi_pci_io));
+		unsigned long stride = PI_MMAP_REGS_PGOFF(1) - PI_MMAP_REGS_PGOFF(0);
+		unsigned long bar = (vma->vm_pgoff - PI_MMAP_REGS_PGOFF(0)) / stride;
+		unsigned long pgoff = (vma->vm_pgoff - PI_MMAP_REGS_PGOFF(0)) % stride;
+		unsigned long start, len;
 
-		if ( devicex->mem_mapped == 0 )
-		{		
-			switch (type)
+		if (REG_MMAP == 0 || !capable( CAP_SYS_RAWIO ))
+			return -EPERM;
+		if (!devicex->present || devicex->sim)
+			return -ENODEV;
+		if (bar > 2 || !(pci_resource_flags( devicex->pdev, bar ) & IORESOURCE_MEM))
+			return -EINVAL;
+
+		start = pci_resource_start( devicex->pdev, bar );
+		len = pci_resource_len( devicex->pdev, bar );
+		/* other devices' registers may share the page */
+		if (start & ~PAGE_MASK)
+			return -EINVAL;
+		if ((pgoff + vma_pages( vma )) << PAGE_SHIFT > PAGE_ALIGN(len))
+			return -EINVAL;
+
+		if (REG_MMAP == 1 && princeton_vma_readonly( vma ) != 0)
+			return -EPERM;
+
+		vma->vm_page_prot = pgprot_noncached( vma->vm_page_prot );
+		return io_remap_pfn_range( vma, vma->vm_start, (start >> PAGE_SHIFT) + pgoff,
+					   vma_pages( vma ) << PAGE_SHIFT, vma->vm_page_prot );
+	}
+
+	static void princeton_vm_open( struct vm_area_struct *vma )
+	{
+		struct extension *devicex = vma->vm_private_data;
+
+		atomic_inc( &devicex->mmaps );
+	}
+
+	static void princeton_vm_close( struct vm_area_struct *vma )
+	{
+		struct extension *devicex = vma->vm_private_data;
+
+		atomic_dec( &devicex->mmaps );
+	}
+
+	static const struct vm_operations_struct princeton_vm_ops = {
+		.open  = princeton_vm_open,
+		.close = princeton_vm_close,
+	};
+
+	/******************************************************************************
+	*
+	*	Maps len bytes of a block, from its page skip, at addr of the vma (which
+	*	is left as it is). The pages of coherent memory are found by the DMA API
+	*	(dma_get_sgtable), and mapped non-cacheable if it remapped them so.
+	*
+	******************************************************************************/
+	static int princeton_mmap_block( struct extension *devicex, struct vm_area_struct *vma,
+					 struct pi_dma_node *node, unsigned long addr,
+					 unsigned long skip, unsigned long len )
+	{
+		pgprot_t prot = vma->vm_page_prot;
+		struct scatterlist *sg;
+		struct sg_table sgt;
+		unsigned long pages, n;
+		int status, i;
+
+		status = dma_get_sgtable( devicex->dmadev, &sgt, node->virtaddr, pi_node_dma( node ),
+					  princeton_block_bytes( node ) );
+		if (status != 0)
+			return status;
+		if (is_vmalloc_addr( node->virtaddr ))
+			prot = pgprot_dmacoherent( prot );
+
+		for_each_sg( sgt.sgl, sg, sgt.orig_nents, i )
+		{
+			pages = sg->length >> PAGE_SHIFT;
+			if (skip >= pages)
 			{
-				case IOCTL_PCI_WRITE_BYTE:
-					outb( output.data.byte_data, output.port );				
-					break;
-				case IOCTL_PCI_WRITE_WORD:
-					outw( output.data.word_data, output.port );
-					break;
-				case IOCTL_PCI_WRITE_DWORD:
-					outl( output.data.dword_data, output.port );
-					break;
+				skip -= pages;
+				continue;
 			}
+			n = min( (pages - skip) << PAGE_SHIFT, len );
+			status = remap_pfn_range( vma, addr, page_to_pfn( sg_page( sg ) ) + skip, n, prot );
+			if (status != 0)
+				break;
+			addr += n;
+			len -= n;
+			skip = 0;
+			if (len == 0)
+				break;
 		}
-		else
+		sg_free_table( &sgt );
+		return status;
+	}
+
+	/******************************************************************************
+	*
+	*	Maps the DMA buffer in the caller's memory, block after block, so the
+	*	frames can be read where the board wrote them, without IOCTL_PCI_TRANSFER_DATA.
+	*	The offset is the position in the buffer (in pages).
+	*
+	******************************************************************************/
+	static int princeton_mmap( struct file *fp, struct vm_area_struct *vma )
+	{
+		struct extension *devicex;
+		unsigned long total, skip, bpages, addr, len;
+		DWORD i;
+		int status = PIDD_SUCCESS;
+		
+		devicex = (struct extension *)(fp->private_data);
+		if (!devicex->present)
+			return -ENODEV;
+		if (vma->vm_pgoff >= PI_MMAP_REGS_PGOFF(0))
+			return princeton_mmap_regs( devicex, vma );
+		if (vma->vm_pgoff == PI_MMAP_STATUS_PGOFF)
+			return princeton_mmap_status( devicex, vma );
+
+		mutex_lock(&devicex->mutex);
+		if (!devicex->present)
 		{
-			switch(type)
-			{		
-				case IOCTL_PCI_WRITE_BYTE:
-					writeb( output.data.byte_data, (void *)output.port );
-					break;
-				case IOCTL_PCI_WRITE_WORD:
-					writew( output.data.word_data, (void *)output.port );
-					break;
-				case IOCTL_PCI_WRITE_DWORD:
-					writel( output.data.dword_data, (void *)output.port );
-					break;		
+			status = -ENODEV;
+			goto done;
+		}
+
+		/* the application already has its buffer */
+		if (devicex->user_pages)
+		{
+			status = -EINVAL;
+			goto done;
+		}
+
+		/* the blocks may have different sizes */
+		total = 0;
+		for (i=0; i<devicex->numberofentries; i++)
+			total += PAGE_ALIGN( devicex->nodes[i].physsize ) >> PAGE_SHIFT;
+		if (vma->vm_pgoff + vma_pages( vma ) > total)
+		{
+			status = -EINVAL;
+			goto done;
+		}
+
+		/* each block in its part of the vma */
+		addr = vma->vm_start;
+		skip = vma->vm_pgoff;
+		for (i=0; i<devicex->numberofentries && addr < vma->vm_end; i++)
+		{
+			bpages = PAGE_ALIGN( devicex->nodes[i].physsize ) >> PAGE_SHIFT;
+			if (skip >= bpages)
+			{
+				skip -= bpages;
+				continue;
 			}
-		}		
+			len = min( (bpages - skip) << PAGE_SHIFT, vma->vm_end - addr );
+			status = princeton_mmap_block( devicex, vma, &devicex->nodes[i], addr, skip, len );
+			if (status != 0)
+				goto done;
+			addr += len;
+			skip = 0;
+		}
+
+		/* the buffer can't shrink while it's mapped */
+		vma->vm_private_data = devicex;
+		vma->vm_ops = &princeton_vm_ops;
+		atomic_inc( &devicex->mmaps );
+
+	done:
+		mutex_unlock(&devicex->mutex);
+		return status;
+	}
+
+	/******************************************************************************
+	*
+	*	Readable when frames have been counted since the last IOCTL_PCI_GET_IRQS
+	*	or IOCTL_PCI_WAIT_FRAMES, in error when the acquisition failed.
+	*
+	******************************************************************************/
+	static __poll_t princeton_poll( struct file *fp, poll_table *wait )
+	{
+		struct extension *devicex;
+		__poll_t mask = 0;
+		
+		devicex = (struct extension *)(fp->private_data);
+		poll_wait( fp, &devicex->frame_wait, wait );
+
+		if ( devicex->irqs.nframe_count != devicex->poll_seen )
+			mask |= EPOLLIN | EPOLLRDNORM;
+		if ( devicex->irqs.error_occurred )
+			mask |= EPOLLERR;
+		if ( !devicex->present )
+			mask |= EPOLLHUP;
+		return mask;
+	}
+
+	/******************************************************************************
+	*
+	*
+	*
+	*
+	*
+	******************************************************************************/	
+	int princeton_output(	void *io_object, 
+						struct extension *devicex,
+						unsigned int type)
+	{
+		struct pi_pci_io output;
+		void __iomem *addr;
+		int status = 0;
+		
+		if (copy_from_user( &output, io_object, sizeof(struct pi_pci_io)))
+			return -EFAULT;
+
+		switch (type)
+		{
+			case IOCTL_PCI_WRITE_BYTE:
+				addr = princeton_reg_addr( devicex, output.port, 1 );
+				if (addr)
+					princeton_reg_write( devicex, addr, 1, output.data.byte_data );
+				break;
+			case IOCTL_PCI_WRITE_WORD:
+				addr = princeton_reg_addr( devicex, output.port, 2 );
+				if (addr)
+					princeton_reg_write( devicex, addr, 2, output.data.word_data );
+				break;
+			default:
+				addr = princeton_reg_addr( devicex, output.port, 4 );
+				if (addr)
+					princeton_reg_write( devicex, addr, 4, output.data.dword_data );
+				break;
+		}
+		if (addr == NULL)
+			status = -EINVAL;
 		return status;
 	}
 	
+
 	/******************************************************************************
 	*
 	*
@@ -452,46 +1222,163 @@
 						unsigned int type)
 	{
 		struct pi_pci_io input;
+		void __iomem *addr;
 		int status = 0;
 		
-		copy_from_user(&input, io_object, sizeof(struct pi_pci_io));
+		if (copy_from_user(&input, io_object, sizeof(struct pi_pci_io)))
+			return -EFAULT;
+		
+		switch (type)
+		{
+			case IOCTL_PCI_READ_BYTE:
+				addr = princeton_reg_addr( devicex, input.port, 1 );
+				if (addr)
+					input.data.byte_data  = princeton_reg_read( devicex, addr, 1 );
+				break;
+			case IOCTL_PCI_READ_WORD:
+				addr = princeton_reg_addr( devicex, input.port, 2 );
+				if (addr)
+					input.data.word_data  = princeton_reg_read( devicex, addr, 2 );
+				break;
+			default:
+				addr = princeton_reg_addr( devicex, input.port, 4 );
+				if (addr)
+					input.data.dword_data = princeton_reg_read( devicex, addr, 4 );
+				break;
+		}
+		if (addr == NULL)
+			return -EINVAL;
+		
+		if (copy_to_user( io_object, &input, sizeof(struct pi_pci_io)))
+			status = -EFAULT;
+		
+		return status;
+	}
+
+	#define PI_REG_POLL_US	10	/* interval between the reads of PI_REG_POLL */
+
+	/* The long delays can be interrupted by a signal: the caller checks signal_pending() */
+	static void princeton_delay( DWORD us )
+	{
+		if (us < 10)
+			udelay( us );
+		else if (us < 20000)
+			usleep_range( us, us + us / 4 );
+		else
+			msleep_interruptible( us / 1000 );
+	}
+
+	/******************************************************************************
+	*
+	*	Runs a sequence of register accesses in one call. Stops at the first
+	*	operation which fails (a PI_REG_POLL timing out returns -ETIMEDOUT, a
+	*	signal during a wait -EINTR), done tells how many were completed. The
+	*	values read are returned in the operations. The waits are limited to
+	*	PI_REG_DELAY_MAX, as the card is locked meanwhile.
+	*
+	******************************************************************************/
+	int princeton_reg_batch( void *user_object, struct extension *devicex )
+	{
+		struct pi_reg_batch batch;
+		struct pi_reg_op *ops, *op;
+		void __iomem *addr;
+		DWORD value;
+		ktime_t deadline;
+		int status = PIDD_SUCCESS;
 		
-		if ( devicex->mem_mapped == 0 )
+		if (copy_from_user( &batch, user_object, sizeof(struct pi_reg_batch)))
+			return -EFAULT;
+		if (batch.count == 0 || batch.count > PI_REG_BATCH_MAX)
+			return -EINVAL;
+
+		ops = kmalloc_array( batch.count, sizeof(struct pi_reg_op), GFP_KERNEL );
+		if (ops == NULL)
+			return -ENOMEM;
+		if (copy_from_user( ops, batch.ops, batch.count * sizeof(struct pi_reg_op)))
 		{
-			switch (type)
+			kfree( ops );
+			return -EFAULT;
+		}
+
+		for (batch.done = 0; batch.done < batch.count; batch.done++)
+		{
+			op = &ops[batch.done];
+			addr = NULL;
+			if (op->delay_us > PI_REG_DELAY_MAX)
+			{
+				status = -EINVAL;
+				break;
+			}
+			if (op->op != PI_REG_DELAY)
 			{
-				case IOCTL_PCI_READ_BYTE:
-					input.data.byte_data  = inb( input.port );
+				if (op->width != 1 && op->width != 2 && op->width != 4)
+				{
+					status = -EINVAL;
 					break;
-				case IOCTL_PCI_READ_WORD:
-					input.data.word_data  = inw( input.port );
+				}
+				addr = princeton_reg_addr( devicex, op->port, op->width );
+				if (addr == NULL)
+				{
+					status = -EINVAL;
 					break;
-				case IOCTL_PCI_READ_DWORD:
-					input.data.dword_data = inl( input.port );
-					break;		
+				}
 			}
-		}
-		else
-		{
-			switch (type)
+
+			switch (op->op)
 			{
-				case IOCTL_PCI_READ_BYTE:
-					input.data.byte_data  = readb( (void *)input.port );
+				case PI_REG_READ:
+					op->value = princeton_reg_read( devicex, addr, op->width );
+					break;
+				case PI_REG_WRITE:
+					princeton_reg_write( devicex, addr, op->width, op->value );
+					break;
+				case PI_REG_RMW:
+					value = princeton_reg_read( devicex, addr, op->width );
+					op->value = (value & ~op->mask) | (op->value & op->mask);
+					princeton_reg_write( devicex, addr, op->width, op->value );
 					break;
-				case IOCTL_PCI_READ_WORD:
-					input.data.word_data  = readw( (void *)input.port );
+				case PI_REG_POLL:
+					/* the sleeps can last longer than asked, the timeout is measured */
+					deadline = ktime_add_us( ktime_get(), op->delay_us );
+					for (;;)
+					{
+						value = princeton_reg_read( devicex, addr, op->width );
+						if ((value & op->mask) == (op->value & op->mask))
+							break;
+						if (ktime_after( ktime_get(), deadline ))
+						{
+							status = -ETIMEDOUT;
+							break;
+						}
+						if (signal_pending( current ))
+						{
+							status = -EINTR;
+							break;
+						}
+						princeton_delay( PI_REG_POLL_US );
+					}
+					op->value = value;
 					break;
-				case IOCTL_PCI_READ_DWORD:
-					input.data.dword_data = readl( (void *)input.port );
-					break;		
+				case PI_REG_DELAY:
+					princeton_delay( op->delay_us );
+					if (signal_pending( current ))
+						status = -EINTR;
+					break;
+				default:
+					status = -EINVAL;
 			}
+			if (status != PIDD_SUCCESS)
+				break;
 		}
-		
-		__copy_to_user( io_object, &input, sizeof(struct pi_pci_io));
-		
+
+		if (copy_to_user( batch.ops, ops, batch.count * sizeof(struct pi_reg_op)) ||
+		    copy_to_user( user_object, &batch, sizeof(struct pi_reg_batch)))
+			status = -EFAULT;
+		kfree( ops );
 		return status;
 	}
 					
+
 	/******************************************************************************
 	*
 	*
@@ -526,234 +1413,973 @@
 	******************************************************************************/						
 	int princeton_do_scatter(void *dma_object , struct extension *devicex)
 	{
-		int nblocks,i;
-		unsigned long bytes_remaining, bsize;
-		
-		/* Buffer Exists Return Its Dma Information */
-		if (devicex->dmainfo.numberofentries != 0) 
-		{
-			__copy_to_user( dma_object, &devicex->dmainfo, sizeof(struct pi_userdma_info));
-			return PIDD_SUCCESS;
-		}
-		
-		/* Free Last Buffer */
-		princeton_release_scatter( devicex );
+		struct pi_userdma_info *info = (struct pi_userdma_info *)dma_object;
+		DWORD size;
+		int status;
 		
 		if (devicex == NULL)
 			return -EINVAL;
 			
-		copy_from_user( &devicex->dmainfo, dma_object, sizeof(struct pi_userdma_info));
-		
-		if (devicex->dmainfo.size == 0) 
-			return -EINVAL;
+		if (copy_from_user( &size, &info->size, sizeof(DWORD)))
+			return -EFAULT;
 
-		/* allocate memory in blocks */
-		bsize = PAGE_SIZE * IMAGE_PAGES;		
-		nblocks = (devicex->dmainfo.size / bsize);
-		
-		if ((nblocks * bsize) < devicex->dmainfo.size) 
-			nblocks++;
-			
-		if (nblocks >= TABLE_SIZE) 
-			return -ENOMEM;
-		
-		bytes_remaining = devicex->dmainfo.size;
-		for (i=0; i<nblocks; i++) 
+		/* Allocate a buffer if there is none, resize the driver's one to the size asked */
+		if (devicex->numberofentries == 0) 
 		{
-			devicex->dmainfo.nodes[i].virtaddr = (void *)(__get_free_pages(GFP_KERNEL, IMAGE_ORDER));
-			devicex->dmainfo.nodes[i].physaddr = (void *)virt_to_bus(devicex->dmainfo.nodes[i].virtaddr);
-			if (devicex->dmainfo.nodes[i].physaddr != 0) 
-			{
-				if (bytes_remaining < bsize) 
-					bsize = bytes_remaining;
-				devicex->dmainfo.nodes[i].physsize = bsize;
-				bytes_remaining = bytes_remaining - bsize;
-			} 
-			else 
-			{				
-				printk(KERN_INFO "Image allocation failed\n");
-				return -ENOMEM;
-			}
+			if (size == 0) 
+				return -EINVAL;
+			status = princeton_alloc_buffer( devicex, size, 0 );
+			if (status != PIDD_SUCCESS)
+				return status;
 		}
-		
-		devicex->dmainfo.numberofentries = nblocks;
-		
-		__copy_to_user( dma_object, &devicex->dmainfo, sizeof(struct pi_userdma_info));
-		
-		devicex->bufferflag = 1;
+		else if (size != 0 && size != devicex->buffer_size && devicex->user_pages == NULL)
+		{
+			/* the blocks must fit in info->nodes, checked before resizing */
+			status = princeton_resize_buffer( devicex, size, PI_USERDMA_NODES );
+			if (status != PIDD_SUCCESS)
+				return status;
+		}
+
+		/* Only copy the blocks used, if they fit */
+		if (devicex->numberofentries > PI_USERDMA_NODES)
+			return -E2BIG;
+		if (copy_to_user( &info->numberofentries, &devicex->numberofentries, sizeof(DWORD)) ||
+		    copy_to_user( &info->size, &devicex->buffer_size, sizeof(DWORD)) ||
+		    copy_to_user( info->nodes, devicex->nodes,
+				  devicex->numberofentries * sizeof(struct pi_dma_node)))
+			return -EFAULT;
 		
 		return PIDD_SUCCESS;
 	}
 
-
 	/******************************************************************************
 	*
+	*	Resizes the buffer to the size asked, unless it already has this size.
+	*	Fails with -EBUSY if it would shrink a mmap()ed buffer.
 	*
-	*
-	*
-	*
-	******************************************************************************/						
-	void princeton_release_scatter(struct extension *devicex)
+	******************************************************************************/
+	int princeton_allocate_buffer( void *user_object, struct extension *devicex )
 	{
-		int i;
-	   
-		if (devicex == NULL) 
-			return;
-		
-		if (devicex->dmainfo.numberofentries == 0) 
-			return;  
-			
-		for (i=0; i< devicex->dmainfo.numberofentries; i++)
+		struct pi_buffer_info info;
+		int status;
+
+		if (copy_from_user( &info, user_object, sizeof(struct pi_buffer_info)))
+			return -EFAULT;
+		if (info.size == 0)
+			return -EINVAL;
+
+		if (info.size != devicex->buffer_size || devicex->user_pages)
 		{
-//			printk("KERN_INFO  i[numEntries] = %d\n",i);
-			if (devicex->dmainfo.nodes[i].physaddr != 0) 
-				free_pages((int)devicex->dmainfo.nodes[i].virtaddr, IMAGE_ORDER);
-//				free_pages((int)devicex->dmainfo.nodes[i].physaddr, IMAGE_ORDER);
-//  Above change made 2 April 2002, hoping to fix segmentation fault.  WWW says free_pages() should
-//  free memory allocated with get_free_pages(), which was set to virtual memory.  So now we free virtual
-//  memory instead of physical.			
-			devicex->dmainfo.nodes[i].physaddr = 0;
-			devicex->dmainfo.nodes[i].physsize = 0;
+			status = princeton_resize_buffer( devicex, info.size, ULONG_MAX );
+			if (status != PIDD_SUCCESS)
+				return status;
 		}
-		
-		devicex->dmainfo.numberofentries = 0;
+
+		info.numberofentries = devicex->numberofentries;
+		if (copy_to_user( user_object, &info, sizeof(struct pi_buffer_info)))
+			return -EFAULT;
+		return PIDD_SUCCESS;
 	}
 
 	/******************************************************************************
 	*
+	*	Returns the blocks of the buffer from first, as many as fit in the user array.
 	*
-	*
-	*
-	*
-	******************************************************************************/						
-	int princeton_transfer_to_user( void *user_object, struct extension *devicex )
+	******************************************************************************/
+	int princeton_get_nodes( void *user_object, struct extension *devicex )
 	{
-		struct pi_userptr userbuffer;
-		struct pi_dma_node *dmanodes;
-
-		void *virtual;
-		long bytesleft;
-		
-		copy_from_user( &userbuffer, user_object, sizeof(struct pi_userptr ));
-			
-		bytesleft = userbuffer.size;
+		struct pi_dma_nodes req;
 
-		copy_from_user( dmanodeshead, userbuffer.xfernodes, userbuffer.sizeofnodes);
-		dmanodes = dmanodeshead;
+		if (copy_from_user( &req, user_object, sizeof(struct pi_dma_nodes)))
+			return -EFAULT;
 
-		while ( dmanodes != 0 )
-		{
-			virtual = bus_to_virt( (unsigned long)dmanodes->physaddr );
-			__copy_to_user( (caddr_t)userbuffer.address, (caddr_t)virtual, dmanodes->physsize );
-			
-			userbuffer.address 	+= dmanodes->physsize;	
-			dmanodes = dmanodes->next;
-		}
+		req.numberofentries = devicex->numberofentries;
+		req.returned = 0;
+		if (req.first < req.numberofentries)
+			req.returned = min(req.count, req.numberofentries - req.first);
+		if (copy_to_user( req.nodes, devicex->nodes + req.first,
+				  req.returned * sizeof(struct pi_dma_node)))
+			return -EFAULT;
+		if (copy_to_user( user_object, &req, sizeof(struct pi_dma_nodes)))
+			return -EFAULT;
 		return PIDD_SUCCESS;
-	
 	}
-	
+
+
 	/******************************************************************************
 	*
+	*	Releases the application buffer, once the board is stopped: unmapped, and
+	*	unpinned (dirty, the board wrote it). The blocks (nodes) are left to
+	*	princeton_release_scatter.
 	*
-	*
-	*
-	*
-	******************************************************************************/					
-	int princeton_do_scatter_boot(long size, struct extension *devicex)
+	******************************************************************************/
+	static void princeton_release_userptr( struct extension *devicex )
 	{
-		int breakout = 0;
-		int nblocks,i;
-		unsigned long bytes_remaining, bsize;
-		
-		/* allocate memory in blocks */
-		bsize = PAGE_SIZE * IMAGE_PAGES;		
-		nblocks = (size / bsize);
-		
-		if ((nblocks * bsize) < size) 
-			nblocks++;
-			
-		if (nblocks >= TABLE_SIZE) 
-			return -ENOMEM;
-		
-		bytes_remaining = size;
-		for (i=0; i<nblocks; i++) 
+		/* the board may be writing in it */
+		princeton_stop_board( devicex );
+		if (devicex->user_mapped)
 		{
-			devicex->dmainfo.nodes[i].virtaddr = (void *)(__get_free_pages(GFP_KERNEL, IMAGE_ORDER));
-			devicex->dmainfo.nodes[i].physaddr = (void *)virt_to_bus(devicex->dmainfo.nodes[i].virtaddr);
-			if (devicex->dmainfo.nodes[i].physaddr != 0) 
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+			dma_unmap_sgtable( devicex->dmadev, &devicex->user_sgt, DMA_FROM_DEVICE, 0 );
+	#else
+			dma_unmap_sg( devicex->dmadev, devicex->user_sgt.sgl, devicex->user_sgt.orig_nents,
+				      DMA_FROM_DEVICE );
+	#endif
+			devicex->user_mapped = 0;
+		}
+		if (devicex->user_sgt.sgl)
+		{
+			sg_free_table( &devicex->user_sgt );
+			devicex->user_sgt.sgl = NULL;
+		}
+
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+		unpin_user_pages_dirty_lock( devicex->user_pages, devicex->user_npages, true );
+	#else
+		{
+			unsigned long i;
+
+			for (i = 0; i < devicex->user_npages; i++)
 			{
-				if (bytes_remaining < bsize) 
-					bsize = bytes_remaining;
-				devicex->dmainfo.nodes[i].physsize = bsize;
-				bytes_remaining = bytes_remaining - bsize;
-			} 
-			else 
-			{				
-				printk(KERN_INFO "Image allocation failed\n");
-				breakout = 1;
+				set_page_dirty_lock( devicex->user_pages[i] );
+				put_page( devicex->user_pages[i] );
 			}
-			if (breakout) break;
-			
-			//if ( i == 0 )
-			//	printk( "KERN_INFO image block size %i\n",devicex->dmainfo.nodes[i].physsize);
 		}
-		
-/*  Replaced this with line below, should fix memory leak.
-		if ( i != 0 )
-			devicex->dmainfo.numberofentries = i-1;
-		else
-			devicex->dmainfo.numberofentries = 0;
-*/			
-		devicex->dmainfo.numberofentries = i;
+	#endif
+		kvfree( devicex->user_pages );
+		devicex->user_pages = NULL;
+		devicex->user_npages = 0;
+	}
 
-		printk( KERN_INFO "Nodes allocated %i\n", i );
-		
-		devicex->bufferflag = 1;
-		
-		return PIDD_SUCCESS;
-	}	
-	
 	/******************************************************************************
 	*
+	*	Uses an application buffer for the DMA instead of the driver's one: its
+	*	pages are pinned and mapped, and become the blocks returned by
+	*	IOCTL_PCI_ALLOCATE_SG_TABLE and IOCTL_PCI_GET_NODES (virtaddr is then the
+	*	address in the application). Released by a NULL address, the allocation
+	*	of a driver buffer, or the close of the file.
 	*
-	*
-	*
-	*
-	******************************************************************************/					
-	int princeton_get_irqs( void *user_object, struct extension *devicex )
+	******************************************************************************/
+	int princeton_map_userptr( void *user_object, struct extension *devicex )
 	{
-		__copy_to_user( user_object, &devicex->irqs, sizeof(struct pi_irqs));
-		devicex->irqs.interrupt_counter = 0;
-		return (1);
-	}
+		struct pi_userbuf ub;
+		struct scatterlist *sg;
+		unsigned long npages;
+		long pinned;
+		int status, nents, i;
 
-	/******************************************************************************
-	*
-	*
+		if (copy_from_user( &ub, user_object, sizeof(struct pi_userbuf)))
+			return -EFAULT;
+		if (ub.address != NULL &&
+		    (((unsigned long)ub.address & ~PAGE_MASK) || ub.size == 0 || (ub.size & ~PAGE_MASK)))
+			return -EINVAL;
+		if (atomic_read( &devicex->mmaps ))
+			return -EBUSY;
+
+		princeton_release_scatter( devicex );
+		ub.numberofentries = 0;
+		if (ub.address == NULL)
+			goto done;
+
+		npages = ub.size >> PAGE_SHIFT;
+		devicex->user_pages = kvmalloc_array( npages, sizeof(struct page *), GFP_KERNEL );
+		if (devicex->user_pages == NULL)
+			return -ENOMEM;
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+		pinned = pin_user_pages_fast( (unsigned long)ub.address, npages,
+					      FOLL_WRITE | FOLL_LONGTERM, devicex->user_pages );
+	#else
+		pinned = get_user_pages_fast( (unsigned long)ub.address, npages,
+					      FOLL_WRITE, devicex->user_pages );
+	#endif
+		devicex->user_npages = max( pinned, 0L );
+		if (pinned != npages)
+		{
+			status = pinned < 0 ? pinned : -EFAULT;
+			goto error;
+		}
+
+		status = sg_alloc_table_from_pages( &devicex->user_sgt, devicex->user_pages, npages, 0,
+						    ub.size, GFP_KERNEL );
+		if (status != 0)
+		{
+			devicex->user_sgt.sgl = NULL;
+			goto error;
+		}
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+		status = dma_map_sgtable( devicex->dmadev, &devicex->user_sgt, DMA_FROM_DEVICE, 0 );
+	#else
+		devicex->user_sgt.nents = dma_map_sg( devicex->dmadev, devicex->user_sgt.sgl,
+						      devicex->user_sgt.orig_nents, DMA_FROM_DEVICE );
+		status = devicex->user_sgt.nents ? 0 : -EIO;
+	#endif
+		if (status != 0)
+			goto error;
+		devicex->user_mapped = 1;
+
+		/* a block per DMA segment, they cover the buffer in order */
+		nents = devicex->user_sgt.nents;
+		devicex->nodes = kvcalloc( nents, sizeof(struct pi_dma_node), GFP_KERNEL );
+		devicex->block_start = kvcalloc( nents + 1, sizeof(unsigned long), GFP_KERNEL );
+		if (devicex->nodes == NULL || devicex->block_start == NULL)
+		{
+			status = -ENOMEM;
+			goto error;
+		}
+		for_each_sg( devicex->user_sgt.sgl, sg, nents, i )
+		{
+			devicex->nodes[i].virtaddr = ub.address + devicex->block_start[i];
+			devicex->nodes[i].physaddr = (void *)(unsigned long)sg_dma_address( sg );
+			devicex->nodes[i].physsize = sg_dma_len( sg );
+			devicex->block_start[i + 1] = devicex->block_start[i] + sg_dma_len( sg );
+		}
+		devicex->numberofentries = nents;
+		devicex->buffer_size = ub.size;
+		devicex->bufferflag = 1;
+		ub.numberofentries = nents;
+		printk( KERN_INFO "Application buffer of %lu bytes, %d blocks\n", ub.size, nents );
+
+	done:
+		if (copy_to_user( user_object, &ub, sizeof(struct pi_userbuf)))
+			return -EFAULT;
+		return PIDD_SUCCESS;
+
+	error:
+		princeton_release_scatter( devicex );
+		return status;
+	}
+
+	/******************************************************************************
+	*
+	*	Sets the DMA mask of DMA_BITS bits, if the user interface allows it: the
+	*	DMA handles are passed to the user as pointers. The board's AMCC bus
+	*	master is 32 bits, so wider is opt-in; with an IOMMU, the buffer can
+	*	still be anywhere in RAM.
+	*
+	******************************************************************************/
+	int princeton_set_dma_mask( struct pci_dev *dev )
+	{
+		int bits = min_t(int, DMA_BITS, 8 * sizeof(void *));
+
+		if (bits > 32 && dma_set_mask_and_coherent( &dev->dev, DMA_BIT_MASK(bits) ) == 0)
+			return PIDD_SUCCESS;
+		return dma_set_mask_and_coherent( &dev->dev, DMA_BIT_MASK(32) );
+	}
+
+	/******************************************************************************
+	*
+	*	Allocates one block of bytes of the DMA buffer. It can be anywhere in RAM,
+	*	the DMA API takes care of the IOMMU (if any) and of the mask of the board.
+	*	Large blocks come from the CMA area when the kernel has one.
+	*
+	******************************************************************************/
+	int princeton_alloc_block( struct extension *devicex, struct pi_dma_node *node,
+				   unsigned long bytes, gfp_t flags )
+	{
+		dma_addr_t handle;
+
+		node->virtaddr = dma_alloc_coherent( devicex->dmadev, bytes, &handle, flags );
+		if (node->virtaddr == NULL) 
+		{
+			node->physaddr = 0;
+			return -ENOMEM;
+		}
+		node->physaddr = (void *)(unsigned long)handle;
+		return PIDD_SUCCESS;
+	}
+
+	/* Frees the blocks nodes[first] to nodes[last - 1] */
+	static void princeton_free_blocks( struct extension *devicex, struct pi_dma_node *nodes,
+					   DWORD first, DWORD last )
+	{
+		DWORD i;
+
+		for (i = first; i < last; i++)
+		{
+			if (nodes[i].virtaddr != NULL) 
+				dma_free_coherent( devicex->dmadev, princeton_block_bytes( &nodes[i] ),
+						   nodes[i].virtaddr, pi_node_dma( &nodes[i] ) );
+		}
+	}
+
+
+	/******************************************************************************
+	*
+	*	Returns the kernel address of the size bytes at the DMA address dma, or
+	*	NULL if they are not all inside one block of the buffer. The block *hint
+	*	is tried first, and *hint is set to the next one: the nodes of a
+	*	transfer usually follow each other, so the search is then not needed.
+	*
+	******************************************************************************/
+	static inline void *princeton_node_to_virt( struct pi_dma_node *node, dma_addr_t dma,
+						    DWORD size )
+	{
+		if (node->virtaddr == NULL || dma < pi_node_dma( node ))
+			return NULL;
+		if (dma - pi_node_dma( node ) + size > node->physsize)
+			return NULL;
+		return node->virtaddr + (dma - pi_node_dma( node ));
+	}
+
+	void *princeton_dma_to_virt( struct extension *devicex, dma_addr_t dma, DWORD size,
+				     DWORD *hint )
+	{
+		void *virtual;
+		DWORD i;
+
+		if (*hint < devicex->numberofentries)
+		{
+			virtual = princeton_node_to_virt( &devicex->nodes[*hint], dma, size );
+			if (virtual != NULL)
+			{
+				(*hint)++;
+				return virtual;
+			}
+		}
+		for (i=0; i<devicex->numberofentries; i++)
+		{
+			virtual = princeton_node_to_virt( &devicex->nodes[i], dma, size );
+			if (virtual != NULL)
+			{
+				*hint = i + 1;
+				return virtual;
+			}
+		}
+		return NULL;
+	}
+
+
+	/******************************************************************************
+	*
+	*
+	*
+	*
+	*
+	******************************************************************************/						
+	void princeton_release_scatter(struct extension *devicex)
+	{
+		if (devicex == NULL) 
+			return;
+		
+		/* the blocks of an application buffer are not ours */
+		if (devicex->user_pages)
+			princeton_release_userptr( devicex );
+		else if (devicex->nodes == NULL) 
+			return;  
+		else
+			princeton_free_blocks( devicex, devicex->nodes, 0, devicex->numberofentries );
+		
+		kvfree( devicex->nodes );
+		devicex->nodes = NULL;
+		kvfree( devicex->block_start );
+		devicex->block_start = NULL;
+		devicex->numberofentries = 0;
+		devicex->buffer_size = 0;
+	}
+
+
+	/******************************************************************************
+	*
+	*
+	*
+	*
+	*
+	******************************************************************************/						
+	int princeton_transfer_to_user( void *user_object, struct extension *devicex )
+	{
+		struct pi_userptr userbuffer;
+		struct pi_dma_node dmanode, *next;
+		void *virtual;
+		DWORD count, hint = 0;
+		
+		if (copy_from_user( &userbuffer, user_object, sizeof(struct pi_userptr )))
+			return -EFAULT;
+		/* the frames are already in the application buffer */
+		if (devicex->user_pages)
+			return -EINVAL;
+
+		/* The list of nodes is in user memory, fetch them one by one */
+		next = (struct pi_dma_node *)userbuffer.xfernodes;
+		for (count = 0; next != 0; count++)
+		{
+			if (count >= devicex->numberofentries)
+				return -EINVAL;
+			if (copy_from_user( &dmanode, next, sizeof(struct pi_dma_node) ))
+				return -EFAULT;
+
+			virtual = princeton_dma_to_virt( devicex, pi_node_dma( &dmanode ), dmanode.physsize,
+							 &hint );
+			if (virtual == NULL)
+				return -EINVAL;
+			if (copy_to_user( (caddr_t)userbuffer.address, (caddr_t)virtual, dmanode.physsize ))
+				return -EFAULT;
+			
+			userbuffer.address 	+= dmanode.physsize;	
+			next = dmanode.next;
+		}
+		return PIDD_SUCCESS;
+	
+	}
+	
+
+	/******************************************************************************
+	*
+	*	Copies len bytes of the buffer from position pos to the user, across the
+	*	blocks. The block of pos is found by a binary search of their positions.
+	*
+	******************************************************************************/
+	static int princeton_copy_range( struct extension *devicex, char *to,
+					 unsigned long pos, unsigned long len )
+	{
+		DWORD lo = 0, hi = devicex->numberofentries, mid;
+		unsigned long n;
+
+		/* the last block starting at or before pos */
+		while (hi - lo > 1)
+		{
+			mid = lo + (hi - lo) / 2;
+			if (devicex->block_start[mid] <= pos)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		while (len > 0)
+		{
+			n = min( len, devicex->block_start[lo + 1] - pos );
+			if (copy_to_user( to, devicex->nodes[lo].virtaddr + (pos - devicex->block_start[lo]), n ))
+				return -EFAULT;
+			to += n;
+			pos += n;
+			len -= n;
+			lo++;
+		}
+		return PIDD_SUCCESS;
+	}
+
+	/******************************************************************************
+	*
+	*	Copies a rectangle of a frame to the user, row by row, without the
+	*	rest of the frame (see pi_roi_transfer).
+	*
+	******************************************************************************/
+	int princeton_transfer_roi( void *user_object, struct extension *devicex )
+	{
+		struct pi_roi_transfer roi;
+		unsigned long long end;
+		unsigned long frame_pos;
+		char *to;
+		DWORD row;
+		int status;
+
+		if (copy_from_user( &roi, user_object, sizeof(struct pi_roi_transfer)))
+			return -EFAULT;
+		if (devicex->numberofentries == 0)
+			return -ENOMEM;
+		if (devicex->user_pages)
+			return -EINVAL;
+		if (roi.frame_size == 0 || roi.frame_size > devicex->buffer_size ||
+		    roi.rows == 0 || roi.row_bytes == 0)
+			return -EINVAL;
+
+		/* the rectangle must be inside the frame */
+		end = (unsigned long long)roi.offset + (unsigned long long)(roi.rows - 1) * roi.stride +
+		      roi.row_bytes;
+		if (end > roi.frame_size || (roi.rows > 1 && roi.stride < roi.row_bytes))
+			return -EINVAL;
+
+		frame_pos = (roi.frame % (devicex->buffer_size / roi.frame_size)) * roi.frame_size;
+		to = roi.address;
+		for (row = 0; row < roi.rows; row++)
+		{
+			status = princeton_copy_range( devicex, to,
+						       frame_pos + roi.offset + row * roi.stride, roi.row_bytes );
+			if (status != PIDD_SUCCESS)
+				return status;
+			to += roi.row_bytes;
+		}
+		return PIDD_SUCCESS;
+	}
+
+	/* At most this many blocks for size bytes, if they all have the minimum size */
+	static inline unsigned long princeton_max_blocks( unsigned long size )
+	{
+		if ( princeton_adaptive_blocks() )
+			return DIV_ROUND_UP( size, PAGE_SIZE << IMAGE_ORDER );
+		return DIV_ROUND_UP( size, PAGE_SIZE * IMAGE_PAGES );
+	}
+
+	/******************************************************************************
+	*
+	*	Allocates blocks for *bytes_remaining bytes, from nodes[first] (the array
+	*	has room until nodes[last - 1]), and deducts them from *bytes_remaining.
+	*	With MAX_BLOCK_ORDER, the blocks are as large as possible: the order goes
+	*	down each time an allocation fails, until IMAGE_ORDER. Returns the index
+	*	after the last block allocated.
+	*
+	******************************************************************************/
+	static DWORD princeton_add_blocks( struct extension *devicex, struct pi_dma_node *nodes,
+					   DWORD first, DWORD last, unsigned long *bytes_remaining )
+	{
+		DWORD i;
+		unsigned long bsize = PAGE_SIZE * IMAGE_PAGES;
+		int order = MAX_BLOCK_ORDER;
+		gfp_t flags;
+		
+		for (i=first; i<last && *bytes_remaining > 0; ) 
+		{
+			flags = GFP_KERNEL;
+			if ( princeton_adaptive_blocks() )
+			{
+				/* not larger than needed for the last block */
+				while (order > IMAGE_ORDER && (PAGE_SIZE << (order - 1)) >= *bytes_remaining)
+					order--;
+				bsize = PAGE_SIZE << order;
+				if (order > IMAGE_ORDER)
+					flags |= __GFP_NOWARN | __GFP_NORETRY;
+			}
+
+			if (princeton_alloc_block( devicex, &nodes[i], bsize, flags ) != 0) 
+			{				
+				if ( princeton_adaptive_blocks() && order > IMAGE_ORDER )
+				{
+					order--;
+					continue;
+				}
+				printk(KERN_INFO "Image allocation failed\n");
+				break;
+			}
+			nodes[i].physsize = min( bsize, *bytes_remaining );
+			*bytes_remaining -= nodes[i].physsize;
+			i++;
+		}
+		return i;
+	}
+
+	/* Positions of the blocks in the buffer, for the searches (IOCTL_PCI_TRANSFER_ROI) */
+	static unsigned long *princeton_index_blocks( struct pi_dma_node *nodes, DWORD count )
+	{
+		unsigned long *block_start;
+		DWORD i;
+
+		block_start = kvcalloc( count + 1, sizeof(unsigned long), GFP_KERNEL );
+		if (block_start == NULL)
+			return NULL;
+		for (i = 0; i < count; i++)
+			block_start[i + 1] = block_start[i] + nodes[i].physsize;
+		return block_start;
+	}
+
+	/******************************************************************************
+	*
+	*	Allocates a DMA buffer of size bytes, in blocks. If partial, keeps the
+	*	blocks allocated when the memory runs out, otherwise frees them and fails.
+	*
+	******************************************************************************/
+	int princeton_alloc_buffer( struct extension *devicex, DWORD size, int partial )
+	{
+		DWORD nblocks, i;
+		unsigned long bytes_remaining, *block_start;
+		
+		nblocks = princeton_max_blocks( size );
+		if (nblocks == 0 || nblocks > INT_MAX)
+			return -EINVAL;
+
+		devicex->nodes = kvcalloc( nblocks, sizeof(struct pi_dma_node), GFP_KERNEL );
+		if (devicex->nodes == NULL)
+			return -ENOMEM;
+		
+		bytes_remaining = size;
+		i = princeton_add_blocks( devicex, devicex->nodes, 0, nblocks, &bytes_remaining );
+		devicex->numberofentries = i;
+		devicex->buffer_size = size - bytes_remaining;
+
+		printk( KERN_INFO "Nodes allocated %lu\n", i );
+		if (i > 0)
+			printk( KERN_INFO "Block sizes from %lu to %lu bytes\n",
+				devicex->nodes[i - 1].physsize, devicex->nodes[0].physsize );
+
+		block_start = NULL;
+		if (bytes_remaining == 0 || (partial && i > 0))
+			block_start = princeton_index_blocks( devicex->nodes, i );
+		if (block_start == NULL)
+		{
+			princeton_release_scatter( devicex );
+			return -ENOMEM;
+		}
+		kvfree( devicex->block_start );
+		devicex->block_start = block_start;
+		
+		devicex->bufferflag = 1;
+		
+		return PIDD_SUCCESS;
+	}	
+
+	/******************************************************************************
+	*
+	*	Changes the size of the (driver's) buffer in place: the blocks before the
+	*	new size are kept, only the difference is freed or allocated. The last
+	*	block kept is filled up to its allocated size, or cut to the new size
+	*	(reallocated if it would then be freed with the wrong size). A mmap()ed
+	*	buffer can only grow: none of its blocks is freed or cut (-EBUSY). The
+	*	old blocks are only freed once the new ones are allocated, so if the
+	*	memory runs out, the buffer is left as it was. Fails with -E2BIG, without
+	*	any change, if it could need more than max_blocks blocks.
+	*
+	******************************************************************************/
+	int princeton_resize_buffer( struct extension *devicex, DWORD size, DWORD max_blocks )
+	{
+		struct pi_dma_node *nodes;
+		unsigned long *block_start;
+		unsigned long covered, bytes_remaining, alloc;
+		DWORD keep, nblocks, i;
+
+		if (devicex->numberofentries == 0 || devicex->user_pages)
+		{
+			if (princeton_max_blocks( size ) > max_blocks)
+				return -E2BIG;
+			princeton_release_scatter( devicex );
+			return princeton_alloc_buffer( devicex, size, 0 );
+		}
+
+		/* the blocks starting before size are kept, covering the first bytes */
+		for (keep = 0; keep < devicex->numberofentries && devicex->block_start[keep] < size; keep++)
+			;
+		covered = 0;
+		if (keep > 0)
+		{
+			alloc = princeton_block_bytes( &devicex->nodes[keep - 1] );
+			covered = min( alloc, size - devicex->block_start[keep - 1] );
+			/* its allocated size is deduced from what's used */
+			if (princeton_adaptive_blocks() &&
+			    (PAGE_SIZE << max( get_order( covered ), IMAGE_ORDER )) != alloc)
+			{
+				keep--;
+				covered = devicex->block_start[keep];
+			}
+			else
+				covered += devicex->block_start[keep - 1];
+		}
+		if (atomic_read( &devicex->mmaps ) &&
+		    (keep < devicex->numberofentries || covered < devicex->buffer_size))
+			return -EBUSY;
+		bytes_remaining = size - covered;
+
+		/* the new array of blocks, the current one is left alone until it's complete */
+		nblocks = keep + princeton_max_blocks( bytes_remaining );
+		if (nblocks > max_blocks)
+			return -E2BIG;
+		nodes = kvcalloc( nblocks, sizeof(struct pi_dma_node), GFP_KERNEL );
+		if (nodes == NULL)
+			return -ENOMEM;
+		memcpy( nodes, devicex->nodes, keep * sizeof(struct pi_dma_node) );
+		if (keep > 0)
+			nodes[keep - 1].physsize = covered - devicex->block_start[keep - 1];
+
+		i = princeton_add_blocks( devicex, nodes, keep, nblocks, &bytes_remaining );
+		block_start = NULL;
+		if (bytes_remaining == 0)
+			block_start = princeton_index_blocks( nodes, i );
+		if (block_start == NULL)
+		{
+			princeton_free_blocks( devicex, nodes, keep, i );
+			kvfree( nodes );
+			return -ENOMEM;
+		}
+
+		/* the blocks beyond the new size (not mapped, see above) */
+		princeton_free_blocks( devicex, devicex->nodes, keep, devicex->numberofentries );
+		kvfree( devicex->nodes );
+		kvfree( devicex->block_start );
+		devicex->nodes = nodes;
+		devicex->block_start = block_start;
+		devicex->numberofentries = i;
+		devicex->buffer_size = size;
+		printk( KERN_INFO "Buffer resized to %lu bytes: %lu blocks kept, %lu allocated\n",
+			size, keep, i - keep );
+		return PIDD_SUCCESS;
+	}
+
+
+	/******************************************************************************
+	*
+	*	Copies the counters in the status page, for the readers without syscall.
+	*	Called holding irq_lock, the readers check seq (see pi_status).
+	*
+	******************************************************************************/
+	static void princeton_publish_status( struct extension *devicex )
+	{
+		struct pi_status *st = devicex->status;
+		struct pi_irqs *irqs = &devicex->irqs;
+		DWORD blocks = READ_ONCE( devicex->numberofentries );
+
+		WRITE_ONCE( st->seq, st->seq + 1 );
+		smp_wmb();
+		st->triggers = irqs->triggers;
+		st->eofs = irqs->eofs;
+		st->bofs = irqs->bofs;
+		st->interrupt_counter = irqs->interrupt_counter;
+		st->avail = irqs->avail;
+		st->nframe_count = irqs->nframe_count;
+		st->error_occurred = irqs->error_occurred;
+		st->violations = irqs->violations;
+		st->fifo_full = irqs->fifo_full;
+		st->last_block = (irqs->avail && blocks) ? (irqs->avail - 1) % blocks : 0;
+		smp_wmb();
+		WRITE_ONCE( st->seq, st->seq + 1 );
+	}
+
+	/******************************************************************************
+	*
+	*
+	*
+	*
+	*
+	******************************************************************************/					
+	int princeton_get_irqs( void *user_object, struct extension *devicex )
+	{
+		struct pi_irqs irqs;
+
+		spin_lock_irq( &devicex->irq_lock );
+		irqs = devicex->irqs;
+		devicex->irqs.interrupt_counter = 0;
+		princeton_publish_status( devicex );
+		spin_unlock_irq( &devicex->irq_lock );
+
+		devicex->poll_seen = irqs.nframe_count;
+		if (copy_to_user( user_object, &irqs, sizeof(struct pi_irqs)))
+			return -EFAULT;
+		return (1);
+	}
+
+	static inline int princeton_frames_arrived( struct extension *devicex, DWORD since, DWORD frames )
+	{
+		return devicex->irqs.nframe_count - since >= frames || devicex->irqs.error_occurred ||
+		       !devicex->present;
+	}
+
+	/******************************************************************************
+	*
+	*	Waits until the frame count has advanced by the number asked.
+	*	Returns -ETIMEDOUT if the timeout expired first, -EIO on acquisition error.
+	*
+	******************************************************************************/
+	int princeton_wait_frames( void *user_object, struct extension *devicex )
+	{
+		struct pi_wait_frames wf;
+		long ret;
+
+		if (copy_from_user( &wf, user_object, sizeof(struct pi_wait_frames)))
+			return -EFAULT;
+
+		if (wf.timeout == 0)
+			ret = wait_event_interruptible( devicex->frame_wait,
+					princeton_frames_arrived( devicex, wf.since, wf.frames ) );
+		else
+		{
+			ret = wait_event_interruptible_timeout( devicex->frame_wait,
+					princeton_frames_arrived( devicex, wf.since, wf.frames ),
+					msecs_to_jiffies( wf.timeout ) );
+			if (ret == 0)
+				ret = -ETIMEDOUT;
+			else if (ret > 0)
+				ret = PIDD_SUCCESS;
+		}
+		if (ret == -ERESTARTSYS)
+			return ret;
+		if (!devicex->present)
+			return -ENODEV;
+
+		wf.nframe_count = devicex->irqs.nframe_count;
+		devicex->poll_seen = wf.nframe_count;
+		if (copy_to_user( user_object, &wf, sizeof(struct pi_wait_frames)))
+			return -EFAULT;
+		if (ret == PIDD_SUCCESS && devicex->irqs.error_occurred)
+			return -EIO;
+		return ret;
+	}
+
+	/******************************************************************************
+	*
+	*
+	*
+	*
+	*
+	******************************************************************************/					
+	int princeton_clear_counters( struct extension *devicex )
+	{
+		struct extension *ext = devicex;
+		
+		spin_lock_irq( &ext->irq_lock );
+		ext->irqs.interrupt_counter = 0;
+		ext->irqs.triggers 			= 0;
+		ext->irqs.eofs 				= 0;
+		ext->irqs.bofs 				= 0;
+		ext->irqs.violations 		= 0;
+		ext->irqs.fifo_full 		= 0;
+		ext->irqs.error_occurred 	= 0;
+		ext->irqs.avail 			= 0;
+		ext->irqs.nframe_count 		= 0;
+		memset( &ext->pending, 0, sizeof(struct pi_irq_pending) );
+		/* the events of the previous acquisition are dropped */
+		smp_store_release( &ext->event_tail, READ_ONCE( ext->event_head ) );
+		ext->last_eof = 0;
+		ext->violation_run = 0;
+		princeton_publish_status( ext );
+		spin_unlock_irq( &ext->irq_lock );
+		
+		return ( 1 );
+	}		
+	
+
+	/******************************************************************************
+	*
+	*	Returns the events noted since the last call, oldest first, as many as fit.
+	*	Runs under the mutex: it's the only reader of the ring.
+	*
+	******************************************************************************/
+	int princeton_read_events( void *user_object, struct extension *devicex )
+	{
+		struct pi_events req;
+		unsigned int head, tail, n, first;
+
+		if (copy_from_user( &req, user_object, sizeof(struct pi_events)))
+			return -EFAULT;
+
+		tail = devicex->event_tail;
+		head = smp_load_acquire( &devicex->event_head );
+		n = min_t(DWORD, head - tail, req.count);
+
+		/* in two parts if it wraps around the end of the ring */
+		first = min(n, PI_EVENT_RING - (tail & (PI_EVENT_RING - 1)));
+		if (copy_to_user( req.events, &devicex->events[tail & (PI_EVENT_RING - 1)],
+				  first * sizeof(struct pi_event)) ||
+		    copy_to_user( req.events + first, devicex->events,
+				  (n - first) * sizeof(struct pi_event)))
+			return -EFAULT;
+		smp_store_release( &devicex->event_tail, tail + n );
+
+		req.returned = n;
+		req.lost = READ_ONCE( devicex->events_lost );
+		if (copy_to_user( user_object, &req, sizeof(struct pi_events)))
+			return -EFAULT;
+		return PIDD_SUCCESS;
+	}
+
+	/******************************************************************************
+	*
+	*	Sets (or removes, fd < 0) the eventfd signaled by the interrupt handler
+	*	for a type of event. Replaces the previous one.
+	*
+	******************************************************************************/
+	int princeton_set_eventfd( void *user_object, struct extension *devicex )
+	{
+		struct pi_eventfd req;
+		struct eventfd_ctx *ctx = NULL, *old;
+
+		if (copy_from_user( &req, user_object, sizeof(struct pi_eventfd)))
+			return -EFAULT;
+		if (req.type >= PI_EVENT_TYPES)
+			return -EINVAL;
+		if (req.fd >= 0)
+		{
+			ctx = eventfd_ctx_fdget( req.fd );
+			if (IS_ERR(ctx))
+				return PTR_ERR(ctx);
+		}
+
+		spin_lock_irq( &devicex->irq_lock );
+		old = devicex->eventfds[req.type];
+		devicex->eventfds[req.type] = ctx;
+		spin_unlock_irq( &devicex->irq_lock );
+
+		if (old)
+			eventfd_ctx_put( old );
+		return PIDD_SUCCESS;
+	}
+
+	/* Removes all the eventfds, when the file is closed */
+	void princeton_clear_eventfds( struct extension *devicex )
+	{
+		struct eventfd_ctx *old[PI_EVENT_TYPES];
+		int type;
+
+		spin_lock_irq( &devicex->irq_lock );
+		for (type = 0; type < PI_EVENT_TYPES; type++)
+		{
+			old[type] = devicex->eventfds[type];
+			devicex->eventfds[type] = NULL;
+		}
+		spin_unlock_irq( &devicex->irq_lock );
+
+		for (type = 0; type < PI_EVENT_TYPES; type++)
+			if (old[type])
+				eventfd_ctx_put( old[type] );
+	}
+
+	/******************************************************************************
 	*
+	*	Consistent copy of the statistics, without stopping the interrupt handler:
+	*	copied again if it updated them meanwhile.
 	*
+	******************************************************************************/
+	void princeton_get_stats( struct extension *devicex, struct pi_stats *stats )
+	{
+		unsigned int seq;
+
+		do {
+			seq = read_seqbegin( &devicex->stats_lock );
+			*stats = devicex->stats;
+		} while (read_seqretry( &devicex->stats_lock, seq ));
+	}
+
+	static void princeton_show_hist( struct seq_file *m, const char *name,
+					 const unsigned long long *hist )
+	{
+		int i;
+
+		seq_printf( m, "%s (us):\n", name );
+		for (i = 0; i < PI_HIST_BUCKETS; i++)
+		{
+			if (i == 0)
+				seq_printf( m, "  %10s %llu\n", "< 1", hist[i] );
+			else if (i == PI_HIST_BUCKETS - 1)
+				seq_printf( m, "  %9s+ %llu\n", "", hist[i] );
+			else
+				seq_printf( m, "  %10lu %llu\n", 1UL << (i - 1), hist[i] );
+		}
+	}
+
+	/******************************************************************************
 	*
-	******************************************************************************/					
-	int princeton_clear_counters( struct extension *devicex )
+	*	debugfs pipci/rspipciN: the statistics of a board, readable
+	*
+	******************************************************************************/
+	int princeton_stats_show( struct seq_file *m, void *v )
 	{
-		struct extension *ext = devicex;
-		
-		ext->irqs.interrupt_counter = 0;
-		ext->irqs.triggers 			= 0;
-		ext->irqs.eofs 				= 0;
-		ext->irqs.bofs 				= 0;
-		ext->irqs.violations 		= 0;
-		ext->irqs.fifo_full 		= 0;
-		ext->irqs.error_occurred 	= 0;
-		ext->irqs.avail 			= 0;
-		ext->irqs.nframe_count 		= 0;
-		
-		return ( 1 );
-	}		
-	
+		static const char * const names[PI_EVENT_TYPES] = {
+			"triggers", "bofs", "eofs", "dma_tc", "violations", "fifo_full", "recoveries"
+		};
+		struct extension *devicex = m->private;
+		struct pi_stats stats;
+		int i;
+
+		princeton_get_stats( devicex, &stats );
+		seq_printf( m, "interrupts: %llu\n", stats.interrupts );
+		seq_printf( m, "not_ours: %llu\n", stats.not_ours );
+		for (i = 0; i < PI_EVENT_TYPES; i++)
+			seq_printf( m, "%s: %llu\n", names[i], stats.events[i] );
+		seq_printf( m, "events_lost: %llu\n", stats.events_lost );
+		princeton_show_hist( m, "irq_duration", stats.irq_duration );
+		princeton_show_hist( m, "eof_interval", stats.eof_interval );
+		return 0;
+	}
+
 
 	#define  INTCR     0x38  /* interrupt control register          */
+	#define  MCSR      0x3c  /* bus master control/status register  */
+	   #define A2P_ENABLE         0x400       /* add-on to PCI (board to memory) transfers */
+	   #define A2P_RESET          0x4000000   /* reset the add-on to PCI FIFO flags */
 
 	#define CTRL_WR_PCI           0x0         /* taxi ctrl reg; bit defs follow */
    	   #define RESET              0x1
@@ -793,138 +2419,593 @@
 
 	#define MAX_VIOLATIONS 10
 
-	irqreturn_t princeton_handle_irq(int irq, void *devicex)
+	/* Histogram bucket of a duration, see pi_stats */
+	static inline int princeton_hist_bucket( s64 us )
 	{
-	unsigned long  tmp_stat;
-	unsigned short rid_stat, rcd_stat, ctrl_reg;
-	unsigned char  status;
-  	DECLARE_WAIT_QUEUE_HEAD(wq);
-	struct extension *driverx = (struct extension *)devicex;
+		if (us <= 0)
+			return 0;
+		return min( fls64( us ), PI_HIST_BUCKETS - 1 );
+	}
 
-	if ( !driverx )
-		return 0;
-		
-	if ( driverx->irq != irq )
-		return 0;
+	/******************************************************************************
+	*
+	*	Counts an event, signals its eventfd if any, and notes it in the ring
+	*	for IOCTL_PCI_READ_EVENTS. Called by the
+	*	interrupt handler only (holding irq_lock), the reader doesn't lock: the
+	*	event is written before head moves past it. Dropped if the ring is full.
+	*
+	******************************************************************************/
+	static inline void princeton_event( struct extension *driverx, unsigned short type, ktime_t now )
+	{
+		struct pi_irq_pending *p = &driverx->pending;
+		unsigned int head = driverx->event_head;
+		struct pi_event *event;
 
-    /* Clear AMCC IRQ source and disable AMCC Interrupts */
-	if ( driverx->mem_mapped == 1 )
-		tmp_stat = readl((void *)(driverx->base_address0 + INTCR));
-	else		
-		tmp_stat = inl( driverx->base_address0 + INTCR );
-	
-	while (tmp_stat & 0xffff0000L )
+		driverx->stats.events[type]++;
+		if (driverx->eventfds[type])
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+			eventfd_signal( driverx->eventfds[type] );
+	#else
+			eventfd_signal( driverx->eventfds[type], 1 );
+	#endif
+		if (type == PI_EVENT_EOF)
+		{
+			if (driverx->last_eof)
+				driverx->stats.eof_interval[princeton_hist_bucket( ktime_us_delta( now, driverx->last_eof ) )]++;
+			driverx->last_eof = now;
+		}
+
+		if (head - smp_load_acquire( &driverx->event_tail ) >= PI_EVENT_RING)
+		{
+			driverx->events_lost++;
+			driverx->stats.events_lost++;
+			return;
+		}
+		event = &driverx->events[head & (PI_EVENT_RING - 1)];
+		event->timestamp = ktime_to_ns( now );
+		event->type = type;
+		/* what the thread will make of nframe_count */
+		event->frame = driverx->irqs.nframe_count + p->bofs + p->eofs;
+		if ( !driverx->irqs.error_occurred )
+			event->frame += p->dma_tc;
+		smp_store_release( &driverx->event_head, head + 1 );
+	}
+
+
+	/******************************************************************************
+	*
+	*	RECOVER: after a FIFO full or too many violations in a row (without a
+	*	clean end of frame between them), resets the FIFO and the receiver and
+	*	keeps the interrupts enabled, so the acquisition goes on. The frame being
+	*	received is lost, its number is in the PI_EVENT_RECOVERY event.
+	*
+	******************************************************************************/
+	static void princeton_recover( struct extension *driverx, ktime_t now )
+	{
+		unsigned short ctrl_reg;
+
+		ctrl_reg = princeton_reg_read( driverx, driverx->regs[2] + CTRL_WR_PCI, 4 );
+		princeton_reg_write( driverx, driverx->regs[2] + CTRL_WR_PCI, 4, ctrl_reg | FF_RESET );
+		princeton_reg_write( driverx, driverx->regs[2] + CTRL_WR_PCI, 4, ctrl_reg & (~RCV_CLR) );
+		princeton_reg_write( driverx, driverx->regs[2] + CTRL_WR_PCI, 4, ctrl_reg | RCV_CLR | IRQ_EN );
+
+		driverx->violation_run = 0;
+		princeton_event( driverx, PI_EVENT_RECOVERY, now );
+	}
+
+	/******************************************************************************
+	*
+	*	Stops the acquisition: the receiver and the interrupts disabled, and
+	*	the AMCC bus master too, so that the board doesn't write in a buffer
+	*	about to be released. Nothing to do once the board is gone.
+	*
+	******************************************************************************/
+	void princeton_stop_board( struct extension *devicex )
+	{
+		DWORD reg;
+
+		if ( !devicex->present )
+			return;
+		reg = princeton_reg_read( devicex, devicex->regs[2] + CTRL_WR_PCI, 4 );
+		princeton_reg_write( devicex, devicex->regs[2] + CTRL_WR_PCI, 4, reg & ~(IRQ_EN | RCV_CLR) );
+		reg = princeton_reg_read( devicex, devicex->regs[0] + MCSR, 4 );
+		princeton_reg_write( devicex, devicex->regs[0] + MCSR, 4, (reg & ~A2P_ENABLE) | A2P_RESET );
+	}
+
+	/*
+	 * 32 bits register accesses of the top half, for one access method known
+	 * at compile time, so each top half below has no test per access. bar is
+	 * 0 or 2. The I/O ports are accessed directly, not through the iomap cookie.
+	 */
+	#define PI_ACCESS_PIO  0
+	#define PI_ACCESS_MMIO 1
+	#define PI_ACCESS_SIM  2
+
+	static __always_inline DWORD princeton_irq_read( struct extension *devicex, int bar,
+							 unsigned long offset, const int access )
+	{
+		switch (access)
+		{
+			case PI_ACCESS_PIO:
+				return inl( (bar ? devicex->base_address2 : devicex->base_address0) + offset );
+			case PI_ACCESS_MMIO:
+				return readl( devicex->regs[bar] + offset );
+			default:
+				return princeton_sim_read( devicex, devicex->regs[bar] + offset );
+		}
+	}
+
+	static __always_inline void princeton_irq_write( struct extension *devicex, int bar,
+							 unsigned long offset, DWORD value,
+							 const int access )
+	{
+		switch (access)
+		{
+			case PI_ACCESS_PIO:
+				outl( value, (bar ? devicex->base_address2 : devicex->base_address0) + offset );
+				break;
+			case PI_ACCESS_MMIO:
+				writel( value, devicex->regs[bar] + offset );
+				break;
+			default:
+				princeton_sim_write( devicex, devicex->regs[bar] + offset, value );
+		}
+	}
+
+	/******************************************************************************
+	*
+	*	Top half: acknowledges the interrupts of the board and notes them in
+	*	pending, for princeton_irq_thread() to count. The TAXI violations are
+	*	cleared here, as the board keeps interrupting until they are.
+	*	Inlined in one handler per access method, chosen at probe time.
+	*
+	******************************************************************************/
+	static __always_inline irqreturn_t princeton_top_half( int irq, struct extension *driverx,
+								const int access )
 	{
+		unsigned long  tmp_stat;
+		unsigned short rid_stat, ctrl_reg;
+		unsigned char  status;
+		irqreturn_t    ret = IRQ_NONE;
+		ktime_t        start, now;
+
+		if ( !driverx )
+			return IRQ_NONE;
+			
+		if ( driverx->irq != irq )
+			return IRQ_NONE;
+
+		start = ktime_get();
+		spin_lock( &driverx->irq_lock );
+		write_seqlock( &driverx->stats_lock );
+
+		/* Clear AMCC IRQ source and disable AMCC Interrupts */
+		tmp_stat = princeton_irq_read( driverx, 0, INTCR, access );
 		
-		if ( driverx->mem_mapped == 1 )
-			writel( tmp_stat, (void *)(driverx->base_address0 + INTCR));
-		else		
-			outl( tmp_stat, driverx->base_address0 + INTCR);
-		/* Read Taxi EPLD IRQ Status */
-	
-		if ( driverx->mem_mapped == 1 )
-			status = (unsigned char)readl( (void *)(driverx->base_address2 + IRQ_RD_PCI));
-		else	
-			status = (unsigned char)inl( driverx->base_address2 + IRQ_RD_PCI );
-   
-		while (status)                    /* stay in loop until all ints serviced */
+		while (tmp_stat & 0xffff0000L )
 		{
-	    	if ( driverx->mem_mapped == 1 )
-		 		writel( status, (void *)(driverx->base_address2 + IRQ_CLR_WR_PCI));
-			else		
-		 		outl( status, driverx->base_address2 + IRQ_CLR_WR_PCI );
-	
-			if ( status & I_RID1 )           /* controller interrupt data received*/
-			{                                /* read data from TAXI EPLD RID regs */
+			ret = IRQ_WAKE_THREAD;
+			princeton_irq_write( driverx, 0, INTCR, tmp_stat, access );
+
+			/* Read Taxi EPLD IRQ Status */
+			status = (unsigned char)princeton_irq_read( driverx, 2, IRQ_RD_PCI, access );
+	   
+			while (status)                    /* stay in loop until all ints serviced */
+			{
+				princeton_irq_write( driverx, 2, IRQ_CLR_WR_PCI, status, access );
+				now = ktime_get();
+		
+				if ( status & I_RID1 )           /* controller interrupt data received*/
+				{                                /* read data from TAXI EPLD RID regs */
+					rid_stat = (unsigned short)princeton_irq_read( driverx, 2, RID_RD_PCI, access );
 
-				if ( driverx->mem_mapped == 1 )	
-					rid_stat = (unsigned short)readl((void *)( driverx->base_address2 + RID_RD_PCI));
-				else		
-					rid_stat = (unsigned short)inl( driverx->base_address2 + RID_RD_PCI );
+					if ( rid_stat & I_TRIG )
+					{
+						driverx->pending.triggers++;
+						princeton_event( driverx, PI_EVENT_TRIGGER, now );
+					}
+					if ( rid_stat & I_SCAN )
+					{
+						driverx->pending.bofs++;
+						princeton_event( driverx, PI_EVENT_BOF, now );
+					}
+					else if ( rid_stat & I_EOF  )
+					{
+						driverx->pending.eofs++;
+						princeton_event( driverx, PI_EVENT_EOF, now );
+						/* a frame received without violation ends the run */
+						if ( !(status & I_VLTN) )
+							driverx->violation_run = 0;
+					}
+				}
 
-				if ( rid_stat & I_TRIG )
-					driverx->irqs.triggers++;
-				if ( rid_stat & I_SCAN )
+				if ( status & I_DMA_TC )        /* Update DMA Controller Equivalent   */
 				{
-					driverx->irqs.bofs++;
-					driverx->irqs.nframe_count++;
+					driverx->pending.dma_tc++;
+					princeton_event( driverx, PI_EVENT_DMA_TC, now );
 				}
-				else if ( rid_stat & I_EOF  )
+
+				if ( status & I_RCD1 )           /* controller register data received */
+					princeton_irq_read( driverx, 2, RCD_RD_PCI, access ); /* read data from TAXI EPLD RCD regs */
+
+				if(status & I_VLTN)               /* Taxi Violation has occured       */
 				{
-					driverx->irqs.eofs++;		  
-					driverx->irqs.nframe_count++;
+					ctrl_reg = princeton_irq_read( driverx, 2, CTRL_WR_PCI, access ); /* get taxi ctrl reg val */
+					princeton_irq_write( driverx, 2, CTRL_WR_PCI, ctrl_reg & (~RCV_CLR), access );
+					princeton_irq_write( driverx, 2, CTRL_WR_PCI, ctrl_reg |   RCV_CLR, access );
+
+					driverx->pending.violations++;
+					princeton_event( driverx, PI_EVENT_VIOLATION, now );
+					if ( RECOVER )
+					{
+						if ( ++driverx->violation_run > MAX_VIOLATIONS )
+							princeton_recover( driverx, now );
+					}
+					else if ( driverx->irqs.violations + driverx->pending.violations > MAX_VIOLATIONS )
+						princeton_irq_write( driverx, 2, CTRL_WR_PCI, ctrl_reg & (~IRQ_EN), access );
 				}
-			}
 
-			if ( status & I_DMA_TC )        /* Update DMA Controller Equivalent   */
-			{
-				
-				if (!driverx->irqs.error_occurred )
+				if(status & I_FF_FULL)           /* Fifo Full - scrolling is imminent */
 				{
-					driverx->irqs.interrupt_counter++;         /* Yikes! You are hosed by a Faux OS! */
-					driverx->irqs.avail++;
-					driverx->irqs.nframe_count++;
+					driverx->pending.fifo_full++;
+					princeton_event( driverx, PI_EVENT_FIFO_FULL, now );
+					if ( RECOVER )
+						princeton_recover( driverx, now );
 				}
-			}
 
+				status = (unsigned char)princeton_irq_read( driverx, 2, IRQ_RD_PCI, access );
 
-			if ( status & I_RCD1 )           /* controller register data received */
-			{                                /* read data from TAXI EPLD RCD regs */
-				if ( driverx->mem_mapped == 1 )
-					rcd_stat = (unsigned short)readl( (void *) (driverx->base_address2 + RCD_RD_PCI) );
-				else		
-					rcd_stat = (unsigned short)inl( driverx->base_address2 + RCD_RD_PCI );
-			}
+			} /* end while */
+		
+			tmp_stat = princeton_irq_read( driverx, 0, INTCR, access );
+
+		} /*end tmp_stat */
+
+		if ( ret == IRQ_NONE )
+			driverx->stats.not_ours++;
+		else
+		{
+			driverx->stats.interrupts++;
+			driverx->stats.irq_duration[princeton_hist_bucket( ktime_us_delta( ktime_get(), start ) )]++;
+		}
+		write_sequnlock( &driverx->stats_lock );
+		spin_unlock( &driverx->irq_lock );
+		return ret;
+	}
+
+	irqreturn_t princeton_handle_irq_pio(int irq, void *devicex)
+	{
+		return princeton_top_half( irq, devicex, PI_ACCESS_PIO );
+	}
+
+	irqreturn_t princeton_handle_irq_mmio(int irq, void *devicex)
+	{
+		return princeton_top_half( irq, devicex, PI_ACCESS_MMIO );
+	}
+
+	irqreturn_t princeton_handle_irq_sim(int irq, void *devicex)
+	{
+		return princeton_top_half( irq, devicex, PI_ACCESS_SIM );
+	}
+
+
+	/******************************************************************************
+	*
+	*	Bottom half (in a thread): counts the events noted by the top half
+	*	and wakes up the waiters.
+	*
+	******************************************************************************/
+	irqreturn_t princeton_irq_thread(int irq, void *devicex)
+	{
+		struct extension *driverx = (struct extension *)devicex;
+		struct pi_irq_pending *p = &driverx->pending;
+		DWORD nframes;
+		
+		spin_lock_irq( &driverx->irq_lock );
+		nframes = driverx->irqs.nframe_count;
+
+		driverx->irqs.triggers += p->triggers;
+		driverx->irqs.bofs += p->bofs;
+		driverx->irqs.eofs += p->eofs;
+		driverx->irqs.nframe_count += p->bofs + p->eofs;
+
+		if ( !driverx->irqs.error_occurred )
+		{
+			driverx->irqs.interrupt_counter += p->dma_tc;   /* Yikes! You are hosed by a Faux OS! */
+			driverx->irqs.avail += p->dma_tc;
+			driverx->irqs.nframe_count += p->dma_tc;
+		}
+
+		/* with RECOVER, the interrupt handler already got over them */
+		driverx->irqs.violations += p->violations;
+		if ( driverx->irqs.violations > MAX_VIOLATIONS && !RECOVER )
+			driverx->irqs.error_occurred = 1;
+
+		if ( p->fifo_full )
+		{
+			if ( !RECOVER )
+				driverx->irqs.error_occurred = 1;
+			driverx->irqs.fifo_full += p->fifo_full;
+		}
+
+		memset( p, 0, sizeof(struct pi_irq_pending) );
+		princeton_publish_status( driverx );
+		if ( driverx->irqs.nframe_count != nframes || driverx->irqs.error_occurred )
+			wake_up_interruptible( &driverx->frame_wait );
+		spin_unlock_irq( &driverx->irq_lock );
+
+		return IRQ_HANDLED;
+	}
+
+
+	/*------------SIMULATED BOARD----------------------------*/
 
-			if(status & I_VLTN)               /* Taxi Violation has occured       */
+	#define PI_SIM_BASE(bar)	(0x1000UL * ((bar) + 1))	/* its "port" addresses */
+	#define PI_SIM_INTCR_IRQ	0x00800000	/* AMCC INTCR: interrupt asserted */
+
+	static struct extension *sim_card;
+
+	/* The base address and the register (offset) of an address of the simulated board */
+	static int princeton_sim_reg( struct extension *devicex, void __iomem *addr, unsigned long *offset )
+	{
+		int bar;
+
+		for (bar = 0; bar < 3; bar++)
+		{
+			if (addr >= devicex->regs[bar] && addr < devicex->regs[bar] + devicex->reg_len[bar])
 			{
+				*offset = (addr - devicex->regs[bar]) & ~3UL;
+				return bar;
+			}
+		}
+		return -1;
+	}
 
-				if ( driverx->mem_mapped == 1 )
-				{
-					ctrl_reg = readl( (void *)driverx->base_address2 ); /* get taxi ctrl reg val */
-					writel( ctrl_reg & (~RCV_CLR), (void *)driverx->base_address2 );
-					writel( ctrl_reg |   RCV_CLR,  (void *)driverx->base_address2 );
-				}	
-				else		
-				{
-					ctrl_reg = inl( driverx->base_address2 ); /* get taxi ctrl reg val */			
-					outl( ctrl_reg & (~RCV_CLR), driverx->base_address2 );
-					outl( ctrl_reg |   RCV_CLR,  driverx->base_address2 );
-				}
-		  
-				driverx->irqs.violations++;
-				if ( driverx->irqs.violations > MAX_VIOLATIONS )
-				{
-					if ( driverx->mem_mapped == 1 )
-						writel( ctrl_reg & (~IRQ_EN), (void *)driverx->base_address2 );
-					else				
-						outl( ctrl_reg & (~IRQ_EN), driverx->base_address2 );		
-					driverx->irqs.error_occurred = 1;
-				}
+	/******************************************************************************
+	*
+	*	Register read of the simulated board. Reading RID_RD_PCI clears it.
+	*
+	******************************************************************************/
+	DWORD princeton_sim_read( struct extension *devicex, void __iomem *addr )
+	{
+		struct pi_sim *sim = devicex->sim;
+		unsigned long offset, flags;
+		DWORD value;
+		int bar;
+
+		bar = princeton_sim_reg( devicex, addr, &offset );
+		if (bar < 0)
+			return ~0UL;
+
+		spin_lock_irqsave( &sim->lock, flags );
+		if (bar == 0 && offset == INTCR)
+			value = sim->intcr | (sim->regs[0][INTCR / 4] & 0xffff);
+		else if (bar == 2 && offset == CTRL_WR_PCI)
+			value = sim->ctrl;
+		else if (bar == 2 && offset == IRQ_RD_PCI)
+			value = sim->irq_status;
+		else if (bar == 2 && offset == RID_RD_PCI)
+		{
+			value = sim->rid;
+			sim->rid = 0;
+		}
+		else
+			value = sim->regs[bar][offset / 4];
+		spin_unlock_irqrestore( &sim->lock, flags );
+		return value;
+	}
 
+	/******************************************************************************
+	*
+	*	Register write of the simulated board. The interrupt status bits are
+	*	cleared by writing them, setting IRQ_EN starts the acquisition from the
+	*	beginning of the buffer, clearing it stops it.
+	*
+	******************************************************************************/
+	void princeton_sim_write( struct extension *devicex, void __iomem *addr, DWORD value )
+	{
+		struct pi_sim *sim = devicex->sim;
+		unsigned long offset, flags;
+		int bar;
+
+		bar = princeton_sim_reg( devicex, addr, &offset );
+		if (bar < 0)
+			return;
+
+		spin_lock_irqsave( &sim->lock, flags );
+		if (bar == 0 && offset == INTCR)
+		{
+			sim->intcr &= ~(value & 0xffff0000);
+			sim->regs[0][INTCR / 4] = value & 0xffff;
+		}
+		else if (bar == 2 && offset == CTRL_WR_PCI)
+		{
+			if (!(sim->ctrl & IRQ_EN) && (value & IRQ_EN))
+			{
+				sim->node = 0;
+				sim->offset = 0;
 			}
+			if (value & FF_RESET)
+				sim->irq_status &= ~I_FF_FULL;
+			/* the self clearing bits */
+			WRITE_ONCE( sim->ctrl, value & ~(FF_RESET | A_RADR_CLR) );
+		}
+		else if (bar == 2 && offset == IRQ_CLR_WR_PCI)
+			sim->irq_status &= ~value;
+		else
+			sim->regs[bar][offset / 4] = value;
+		spin_unlock_irqrestore( &sim->lock, flags );
+	}
+
+	/*
+	 * Writes the next frame in the DMA buffer, after the previous one, back at
+	 * the beginning at the end of the buffer. Pixel n of frame f is f + n (16 bits).
+	 */
+	static void princeton_sim_fill( struct extension *devicex )
+	{
+		struct pi_sim *sim = devicex->sim;
+		unsigned long left = SIM_FRAME_KB * 1024UL, n, i;
+		struct pi_dma_node *node;
+		unsigned short *pixels;
+		DWORD pixel = 0;
 
-			if(status & I_FF_FULL)           /* Fifo Full - scrolling is imminent */
+		/* the data of an application buffer is left alone, only the interrupts come */
+		while (left > 0 && devicex->numberofentries > 0 && devicex->user_pages == NULL)
+		{
+			if (sim->node >= devicex->numberofentries ||
+			    sim->offset >= devicex->nodes[sim->node].physsize)
 			{
-				driverx->irqs.error_occurred = 1;
-				driverx->irqs.fifo_full++;
+				sim->node = 0;
+				sim->offset = 0;
+			}
+			node = &devicex->nodes[sim->node];
+			n = min( left, node->physsize - sim->offset );
+			pixels = node->virtaddr + sim->offset;
+			for (i = 0; i < n / 2; i++)
+				pixels[i] = sim->frame + pixel++;
+			sim->offset += n;
+			left -= n;
+			if (sim->offset >= node->physsize)
+			{
+				sim->node++;
+				sim->offset = 0;
 			}
+		}
+		sim->frame++;
+	}
+
+	/******************************************************************************
+	*
+	*	A frame of the simulated board: written in the buffer, then the end of
+	*	frame and DMA terminal count interrupts, handled as the real ones.
+	*
+	******************************************************************************/
+	static void princeton_sim_frame( struct work_struct *work )
+	{
+		struct pi_sim *sim = container_of( work, struct pi_sim, work );
+		struct extension *devicex = sim->devicex;
+		unsigned long flags;
+		irqreturn_t ret;
 
-			if ( driverx->mem_mapped == 1 )
-				status = (unsigned char)readl( (void *) (driverx->base_address2 + IRQ_RD_PCI) );
-			else		
-				status = (unsigned char)inl( driverx->base_address2 + IRQ_RD_PCI );
+		mutex_lock( &devicex->mutex );
+		princeton_sim_fill( devicex );
+		mutex_unlock( &devicex->mutex );
 
-		} /* end while */
-	
-		if ( driverx->mem_mapped == 1 )
-			tmp_stat = readl( (void *)(driverx->base_address0 + INTCR) );
-		else		
-			tmp_stat = inl( driverx->base_address0 + INTCR );
+		spin_lock_irqsave( &sim->lock, flags );
+		sim->intcr |= PI_SIM_INTCR_IRQ;
+		sim->irq_status |= I_DMA_TC | I_RID1;
+		sim->rid |= I_EOF;
+		spin_unlock_irqrestore( &sim->lock, flags );
+
+		/* as if the interrupt line was raised */
+		local_irq_save( flags );
+		ret = princeton_handle_irq_sim( devicex->irq, devicex );
+		local_irq_restore( flags );
+		if ( ret == IRQ_WAKE_THREAD )
+			princeton_irq_thread( devicex->irq, devicex );
+	}
 
-	} /*end tmp_stat */                                         /* Re-Write INTCR interrupt mask */ 
+	/* Frame rate of the simulated board, while it's acquiring (IRQ_EN) */
+	static enum hrtimer_restart princeton_sim_tick( struct hrtimer *timer )
+	{
+		struct pi_sim *sim = container_of( timer, struct pi_sim, timer );
+
+		hrtimer_forward_now( timer, ns_to_ktime( NSEC_PER_SEC / SIMULATE ) );
+		if ( READ_ONCE( sim->ctrl ) & IRQ_EN ) {
+			if ( !queue_work( system_highpri_wq, &sim->work ) )
+				sim->missed++;
+		}
+		return HRTIMER_RESTART;
+	}
+
+	/******************************************************************************
+	*
+	*	Creates the simulated board, instead of looking for the PCI ones.
+	*	Its DMA buffer is allocated for a platform device.
+	*
+	******************************************************************************/
+	int princeton_sim_start( void )
+	{
+		struct extension *devicex;
+		struct pi_sim *sim;
+		int bar, err;
+
+		devicex = princeton_new_card();
+		if ( IS_ERR(devicex) )
+			return PTR_ERR(devicex);
+
+		sim = kzalloc( sizeof(struct pi_sim), GFP_KERNEL );
+		if ( sim == NULL ) {
+			err = -ENOMEM;
+			goto error;
+		}
+		sim->pdev = platform_device_register_simple( DEVICE_NAME "-sim", devicex->minor, NULL, 0 );
+		if ( IS_ERR(sim->pdev) ) {
+			err = PTR_ERR(sim->pdev);
+			kfree( sim );
+			goto error;
+		}
+		sim->devicex = devicex;
+		spin_lock_init( &sim->lock );
+		INIT_WORK( &sim->work, princeton_sim_frame );
+		static_branch_enable( &princeton_sim_key );
+		devicex->sim = sim;
+
+		devicex->dmadev = &sim->pdev->dev;
+		if ( dma_coerce_mask_and_coherent( devicex->dmadev,
+				DMA_BIT_MASK( min_t(int, DMA_BITS, 8 * sizeof(void *)) ) ) != 0 )
+			printk(KERN_INFO "No suitable DMA mask, the buffer can't be allocated\n");
 
-	wake_up_interruptible(&wq);
-  return 0;
+		for ( bar = 0; bar < 3; bar++ ) {
+			devicex->regs[bar] = (void __force __iomem *)sim->regs[bar];
+			devicex->reg_len[bar] = sizeof(sim->regs[bar]);
+		}
+		devicex->base_address0 = PI_SIM_BASE(0);
+		devicex->base_address1 = PI_SIM_BASE(1);
+		devicex->base_address2 = PI_SIM_BASE(2);
+
+		err = princeton_add_card( devicex, &sim->pdev->dev );
+		if ( err < 0 )
+			goto error;
+
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+		hrtimer_setup( &sim->timer, princeton_sim_tick, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+	#else
+		hrtimer_init( &sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL );
+		sim->timer.function = princeton_sim_tick;
+	#endif
+		hrtimer_start( &sim->timer, ns_to_ktime( NSEC_PER_SEC / SIMULATE ), HRTIMER_MODE_REL );
+		sim_card = devicex;
+		printk(KERN_INFO "Simulated card: %d frames of %d KB per second\n", SIMULATE, SIM_FRAME_KB);
+		return 0;
+
+	error:
+		kref_put( &devicex->kref, princeton_delete );
+		return err;
 	}
 
+	/******************************************************************************
+	*
+	*	Removes the simulated board, as if it was unplugged.
+	*
+	******************************************************************************/
+	void princeton_sim_stop( void )
+	{
+		struct extension *devicex = sim_card;
+
+		if ( devicex == NULL )
+			return;
+		hrtimer_cancel( &devicex->sim->timer );
+		cancel_work_sync( &devicex->sim->work );
+		printk(KERN_INFO "Simulated card: %lu frames, %lu missed\n",
+		       devicex->sim->frame, devicex->sim->missed);
+
+		princeton_del_card( devicex );
+		mutex_lock( &devicex->mutex );
+		devicex->present = 0;
+		mutex_unlock( &devicex->mutex );
+
+		wake_up_interruptible( &devicex->frame_wait );
+		sim_card = NULL;
+		kref_put( &devicex->kref, princeton_delete );
+	}
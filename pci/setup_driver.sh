@@ -8,7 +8,8 @@ echo PI PCI Driver Installation: $NCAMPI Princeton Instruments type cameras foun
 x=0
 while [ $x -lt $NCAMPI ]
 do
-  mknod /dev/rspipci$x c 177 $x
+  # the driver creates them itself (with udev), only for the older systems
+  [ -e /dev/rspipci$x ] || mknod /dev/rspipci$x c 177 $x
   x=`expr $x + 1`
 done  
 
@@ -0,0 +1,112 @@
+/* piusb_frame.h */
+
+/*
+ * Frame assembly of the pixel data: accounts the completed URBs into the frames
+ * of the ring, and hands the frames received to the reader in order.
+ * It doesn't touch the USB nor the hardware, only this structure, so it can be
+ * fed with any sequence of completions. The caller serializes the calls.
+ */
+
+#ifndef PIUSB_FRAME_H
+#define PIUSB_FRAME_H
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+
+struct piusb_frame_asm {
+    unsigned long           frame_size;     /* bytes per frame */
+    int                     num_frames;     /* frames in the ring */
+    int                     frame_idx;      /* frame being received */
+    int                     urb_idx;        /* next URB expected in this frame */
+    unsigned long           byte_trk;       /* bytes received of this frame */
+    size_t                  size_returned;  /* bytes of the last frame completed */
+    int                     active_frame;   /* oldest frame not read yet */
+    int                     ready;          /* frames received, not read yet */
+    int                     error;          /* error to report to the reader, or 0 */
+    __u64                   seq;            /* sequence number of active_frame */
+};
+
+/*
+ * Start a new acquisition, with num_frames frames of frame_size bytes.
+ * The sequence numbers keep counting.
+ */
+static inline void piusb_fa_init(struct piusb_frame_asm *fa, unsigned long frame_size,
+				 int num_frames)
+{
+	fa->frame_size = frame_size;
+	fa->num_frames = num_frames;
+	fa->frame_idx = 0;
+	fa->urb_idx = 0;
+	fa->byte_trk = 0;
+	fa->size_returned = 0;
+	fa->active_frame = 0;
+	fa->ready = 0;
+	fa->error = 0;
+}
+
+/*
+ * Account the completion of the next URB of the frame being received.
+ * Returns 1 if it completes the frame, 0 if more URBs are needed, or the URB
+ * status if it failed (the reader will then get -EPIPE).
+ */
+static inline int piusb_fa_complete(struct piusb_frame_asm *fa, int status,
+				    unsigned int actual_length)
+{
+	// for these 3 errors -> we might have still received something
+	if (status &&
+	    !(status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)) {
+		fa->error = -EPIPE; // tell there is no hope
+		return status;
+	}
+
+	fa->byte_trk += actual_length;
+	fa->urb_idx++;  //point to next URB when we callback
+	if (fa->byte_trk < fa->frame_size)
+		return 0;
+
+	fa->size_returned = fa->byte_trk;
+	fa->byte_trk = 0;
+	fa->frame_idx = (fa->frame_idx + 1) % fa->num_frames;
+	fa->urb_idx = 0;
+	fa->ready++;
+	return 1;
+}
+
+/* Returns the oldest frame received and not read yet, or -1 if none */
+static inline int piusb_fa_peek(const struct piusb_frame_asm *fa)
+{
+	return fa->ready ? fa->active_frame : -1;
+}
+
+/* The oldest frame has been read, its buffers can be reused */
+static inline void piusb_fa_consume(struct piusb_frame_asm *fa)
+{
+	fa->ready--;
+	fa->active_frame = (fa->active_frame + 1) % fa->num_frames;
+	fa->seq++;
+}
+
+/* Returns the error received, and forgets it */
+static inline int piusb_fa_take_error(struct piusb_frame_asm *fa)
+{
+	int err = fa->error;
+
+	fa->error = 0;
+	return err;
+}
+
+/*
+ * Drop the frame partially received (eg, after a reset), so that it is
+ * received again from its start. Returns the number of its URBs which had
+ * already completed.
+ */
+static inline int piusb_fa_restart(struct piusb_frame_asm *fa)
+{
+	int partial = fa->urb_idx;
+
+	fa->byte_trk = 0;
+	fa->urb_idx = 0;
+	return partial;
+}
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * piusb_frame_test.c
+ *
+ * KUnit tests of the frame assembly (piusb_frame.h), fed with synthetic URB
+ * completions, and microbenchmarks of the cost per completion.
+ * Built as piusb_frame_test.ko when the kernel has CONFIG_KUNIT, and run when
+ * loaded (the results are in dmesg, or under /sys/kernel/debug/kunit/).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation version 2 of the License
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+
+#include "piusb_frame.h"
+
+/* Feed the completions of a whole frame of n URBs of length bytes */
+static int feed_frame(struct piusb_frame_asm *fa, int n, unsigned int length)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < n; i++)
+		ret = piusb_fa_complete(fa, 0, length);
+	return ret;
+}
+
+static void piusb_frame_exact_urbs(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+
+	piusb_fa_init(&fa, 3 * 512, 4);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 512), 0);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 512), 0);
+	KUNIT_EXPECT_EQ(test, fa.urb_idx, 2);
+	KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), -1);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 512), 1);
+
+	KUNIT_EXPECT_EQ(test, fa.size_returned, (size_t)3 * 512);
+	KUNIT_EXPECT_EQ(test, fa.byte_trk, 0UL);
+	KUNIT_EXPECT_EQ(test, fa.urb_idx, 0);
+	KUNIT_EXPECT_EQ(test, fa.frame_idx, 1);
+	KUNIT_EXPECT_EQ(test, fa.ready, 1);
+	KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), 0);
+}
+
+static void piusb_frame_short_packets(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+	int i;
+
+	/* the last URB of the frame is short */
+	piusb_fa_init(&fa, 1000, 2);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 512), 0);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 488), 1);
+	KUNIT_EXPECT_EQ(test, fa.size_returned, (size_t)1000);
+
+	/* short packets in the middle of the frame: more URBs are needed */
+	for (i = 0; i < 9; i++)
+		KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 100), 0);
+	KUNIT_EXPECT_EQ(test, fa.byte_trk, 900UL);
+	KUNIT_EXPECT_EQ(test, fa.urb_idx, 9);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 100), 1);
+	KUNIT_EXPECT_EQ(test, fa.ready, 2);
+
+	/* zero length packets don't complete anything */
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 0), 0);
+	KUNIT_EXPECT_EQ(test, fa.byte_trk, 0UL);
+	KUNIT_EXPECT_EQ(test, fa.urb_idx, 1);
+}
+
+static void piusb_frame_errors(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+
+	piusb_fa_init(&fa, 1024, 2);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 512), 0);
+
+	/* a real error isn't accounted, and is reported once as -EPIPE */
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, -EPROTO, 512), -EPROTO);
+	KUNIT_EXPECT_EQ(test, fa.byte_trk, 512UL);
+	KUNIT_EXPECT_EQ(test, fa.urb_idx, 1);
+	KUNIT_EXPECT_EQ(test, piusb_fa_take_error(&fa), -EPIPE);
+	KUNIT_EXPECT_EQ(test, piusb_fa_take_error(&fa), 0);
+
+	/* unlinked or shut down: what was received still counts */
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, -ENOENT, 256), 0);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, -ECONNRESET, 128), 0);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, -ESHUTDOWN, 128), 1);
+	KUNIT_EXPECT_EQ(test, fa.ready, 1);
+	KUNIT_EXPECT_EQ(test, piusb_fa_take_error(&fa), 0);
+}
+
+static void piusb_frame_spanning(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+
+	/* a transfer running past the end of the frame completes it... */
+	piusb_fa_init(&fa, 1000, 3);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 600), 0);
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 600), 1);
+	KUNIT_EXPECT_EQ(test, fa.size_returned, (size_t)1200);
+
+	/* ...and the next frame starts from zero, the excess isn't carried */
+	KUNIT_EXPECT_EQ(test, fa.byte_trk, 0UL);
+	KUNIT_EXPECT_EQ(test, fa.frame_idx, 1);
+
+	/* a single transfer larger than the frame */
+	KUNIT_EXPECT_EQ(test, piusb_fa_complete(&fa, 0, 4096), 1);
+	KUNIT_EXPECT_EQ(test, fa.size_returned, (size_t)4096);
+	KUNIT_EXPECT_EQ(test, fa.frame_idx, 2);
+	KUNIT_EXPECT_EQ(test, fa.ready, 2);
+}
+
+static void piusb_frame_odd_rings(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+	int num_frames, i;
+
+	for (num_frames = 1; num_frames <= 7; num_frames += 2) {
+		fa.seq = 0;
+		piusb_fa_init(&fa, 2048, num_frames);
+		for (i = 0; i < 3 * num_frames + 1; i++) {
+			KUNIT_EXPECT_EQ(test, feed_frame(&fa, 4, 512), 1);
+			KUNIT_EXPECT_EQ(test, fa.frame_idx, (i + 1) % num_frames);
+			KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), i % num_frames);
+			piusb_fa_consume(&fa);
+			KUNIT_EXPECT_EQ(test, fa.active_frame, (i + 1) % num_frames);
+			KUNIT_EXPECT_EQ(test, fa.ready, 0);
+		}
+		KUNIT_EXPECT_EQ(test, fa.seq, (__u64)(3 * num_frames + 1));
+	}
+}
+
+static void piusb_frame_ring_order(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+
+	/* frames received ahead of the reader are handed out in order */
+	piusb_fa_init(&fa, 512, 3);
+	feed_frame(&fa, 1, 512);
+	feed_frame(&fa, 1, 512);
+	KUNIT_EXPECT_EQ(test, fa.ready, 2);
+	KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), 0);
+	piusb_fa_consume(&fa);
+	feed_frame(&fa, 1, 512);
+	KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), 1);
+	piusb_fa_consume(&fa);
+	KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), 2);
+	piusb_fa_consume(&fa);
+	KUNIT_EXPECT_EQ(test, piusb_fa_peek(&fa), -1);
+	KUNIT_EXPECT_EQ(test, fa.seq, (__u64)3);
+
+	/* a new acquisition keeps the sequence numbers */
+	piusb_fa_init(&fa, 512, 5);
+	KUNIT_EXPECT_EQ(test, fa.seq, (__u64)3);
+	KUNIT_EXPECT_EQ(test, fa.ready, 0);
+}
+
+static void piusb_frame_restart(struct kunit *test)
+{
+	struct piusb_frame_asm fa = { 0 };
+
+	piusb_fa_init(&fa, 4 * 512, 2);
+	feed_frame(&fa, 4, 512);
+	feed_frame(&fa, 3, 512);
+	KUNIT_EXPECT_EQ(test, piusb_fa_restart(&fa), 3);
+	KUNIT_EXPECT_EQ(test, fa.byte_trk, 0UL);
+	KUNIT_EXPECT_EQ(test, fa.urb_idx, 0);
+
+	/* the frame already received is kept, the partial one starts over */
+	KUNIT_EXPECT_EQ(test, fa.ready, 1);
+	KUNIT_EXPECT_EQ(test, fa.frame_idx, 1);
+	KUNIT_EXPECT_EQ(test, feed_frame(&fa, 3, 512), 0);
+	KUNIT_EXPECT_EQ(test, feed_frame(&fa, 1, 512), 1);
+	KUNIT_EXPECT_EQ(test, fa.ready, 2);
+}
+
+static struct kunit_case piusb_frame_cases[] = {
+	KUNIT_CASE(piusb_frame_exact_urbs),
+	KUNIT_CASE(piusb_frame_short_packets),
+	KUNIT_CASE(piusb_frame_errors),
+	KUNIT_CASE(piusb_frame_spanning),
+	KUNIT_CASE(piusb_frame_odd_rings),
+	KUNIT_CASE(piusb_frame_ring_order),
+	KUNIT_CASE(piusb_frame_restart),
+	{}
+};
+
+static struct kunit_suite piusb_frame_suite = {
+	.name = "piusb_frame",
+	.test_cases = piusb_frame_cases,
+};
+
+/*
+ * Microbenchmarks: cost of each completion, as in the read callback, with the
+ * reader consuming the frames as soon as they are ready. Reported with
+ * kunit_info(), to compare between driver changes on the same machine.
+ */
+#define PIUSB_BENCH_COMPLETIONS 1000000
+
+static void piusb_frame_bench(struct kunit *test, int urbs_per_frame, int num_frames)
+{
+	struct piusb_frame_asm fa = { 0 };
+	u64 start, elapsed;
+	int i, frames = 0;
+
+	piusb_fa_init(&fa, urbs_per_frame * 16384UL, num_frames);
+	start = ktime_get_ns();
+	for (i = 0; i < PIUSB_BENCH_COMPLETIONS; i++) {
+		if (piusb_fa_complete(&fa, 0, 16384) == 1) {
+			piusb_fa_consume(&fa);
+			frames++;
+		}
+	}
+	elapsed = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, frames, PIUSB_BENCH_COMPLETIONS / urbs_per_frame);
+	kunit_info(test, "%d URBs per frame, %d frames: %llu ps per completion\n",
+		   urbs_per_frame, num_frames,
+		   div_u64(elapsed * 1000, PIUSB_BENCH_COMPLETIONS));
+}
+
+static void piusb_frame_bench_small(struct kunit *test)
+{
+	piusb_frame_bench(test, 1, 2);
+}
+
+static void piusb_frame_bench_large(struct kunit *test)
+{
+	piusb_frame_bench(test, 64, 7);
+}
+
+static struct kunit_case piusb_frame_bench_cases[] = {
+	KUNIT_CASE(piusb_frame_bench_small),
+	KUNIT_CASE(piusb_frame_bench_large),
+	{}
+};
+
+static struct kunit_suite piusb_frame_bench_suite = {
+	.name = "piusb_frame_bench",
+	.test_cases = piusb_frame_bench_cases,
+};
+
+kunit_test_suites(&piusb_frame_suite, &piusb_frame_bench_suite);
+
+MODULE_DESCRIPTION("KUnit tests of the PI USB frame assembly");
+MODULE_LICENSE("GPL");
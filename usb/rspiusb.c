@@ -26,6 +26,7 @@
 #include <linux/module.h>
 #include <linux/completion.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
 #include <asm/uaccess.h>
 #include <linux/usb.h>
 #if	LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
@@ -63,6 +64,63 @@ static struct usb_driver piusb_driver;
 static int lastErr;
 static int errCnt;
 
+/*
+ * Transfer settings of each controller. Endpoints are indexes in hEP[], which
+ * are also the numbers used by the user-space in ioctl_struct.endpoint.
+ * The size of each URB shouldn't be too big, or it might fail to be allocated.
+ * 100 Kb is safe, 1Mb seemed to work fine too.
+ */
+static const struct piusb_profile piusb_profiles[] = {
+	{
+		.pid = ST133_PID,
+		.name = "ST133 USB Controller",
+		.num_pixel_ep = 1,
+		.pixel_ep = { 0 },
+		.num_io_ep = 1,
+		.io_ep = { 1 },
+		.urb_size = 102400,
+		.queue_depth = 0,
+	},
+	{
+		.pid = PIXIS_PID,
+		.name = "Pixis Camera",
+		.num_pixel_ep = 2, // EP2 (ping) for even frames, EP4 (pong) for odd ones
+		.pixel_ep = { 2, 3 },
+		.num_io_ep = 2,
+		.io_ep = { 0, 4 },
+		.urb_size = 102400,
+		.queue_depth = 0,
+	},
+};
+
+/* Pipe receiving the pixel data of the given frame */
+static unsigned int piusb_pixel_pipe(struct device_extension *pdx, int frame)
+{
+	const struct piusb_profile *prof = pdx->profile;
+
+	return pdx->hEP[prof->pixel_ep[frame % prof->num_pixel_ep]];
+}
+
+static int piusb_is_pixel_ep(struct device_extension *pdx, int ep)
+{
+	int i;
+
+	for (i = 0; i < pdx->profile->num_pixel_ep; i++)
+		if (pdx->profile->pixel_ep[i] == ep)
+			return 1;
+	return 0;
+}
+
+static int piusb_is_io_ep(struct device_extension *pdx, int ep)
+{
+	int i;
+
+	for (i = 0; i < pdx->profile->num_io_ep; i++)
+		if (pdx->profile->io_ep[i] == ep)
+			return 1;
+	return 0;
+}
+
 /**
  *  piusb_write_bulk_callback
  *  called when the urb submitted by piusb_write_bulk is done writing.
@@ -133,34 +191,54 @@ done:
 	return retval;
 }
 
+/**
+ * Submit URB i of frame f. It's marked pending before the submission, under
+ * frame_lock like its completion, so a fast completion can't be overwritten.
+ */
+static int piusb_submit_pixel_urb(struct device_extension *pdx, int f, int i, gfp_t mem_flags)
+{
+	int err;
+
+	spin_lock_irq(&pdx->frame_lock);
+	pdx->pendedPixelUrbs[f][i] = 1;
+	spin_unlock_irq(&pdx->frame_lock);
+
+	err = usb_submit_urb(pdx->PixelUrb[f][i], mem_flags);
+	if (err) {
+		spin_lock_irq(&pdx->frame_lock);
+		pdx->pendedPixelUrbs[f][i] = 0;
+		spin_unlock_irq(&pdx->frame_lock);
+	}
+	return err;
+}
 
 #ifdef USE_DMA_MAPPING
 static void piusb_read_pixel_callback ( struct urb *urb )
 {
 	struct device_extension *pdx = urb->context;
-	int status = urb->status;
+	unsigned long bytes;
+	int f, i, ret;
 
-	if (status &&
-	    // for these 3 errors -> we might have still received something
-	    !(status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)) {
-		dbg("%s - nonzero read bulk status received: %d", __func__, urb->status);
-		dbg( "Error in read EP2 callback" );
-		dbg( "FrameIndex = %d", pdx->frameIdx );
-		dbg( "Bytes received before problem occurred = %d", pdx->bulk_in_byte_trk );
-		dbg( "Urb Idx = %d", pdx->urbIdx );
-		pdx->pendedPixelUrbs[pdx->frameIdx][pdx->urbIdx] = 0;
+	/* killed to be re-armed after a reset: nothing to account for */
+	if (pdx->resetting)
 		return;
-	}
 
-	pdx->bulk_in_byte_trk += urb->actual_length;
+	spin_lock(&pdx->frame_lock);
+	f = pdx->fa.frame_idx;
+	i = pdx->fa.urb_idx;
+	bytes = pdx->fa.byte_trk;
+	ret = piusb_fa_complete(&pdx->fa, urb->status, urb->actual_length);
+	if (ret < 0)
+		pdx->pendedPixelUrbs[f][i] = 0;
+	spin_unlock(&pdx->frame_lock);
 
-	pdx->urbIdx++;  //point to next URB when we callback
-	if( pdx->bulk_in_byte_trk >= pdx->frameSize ) {
-		pdx->bulk_in_size_returned = pdx->bulk_in_byte_trk;
-		pdx->bulk_in_byte_trk = 0;
-		pdx->gotPixelData = 1;
-		pdx->frameIdx = ( ( pdx->frameIdx + 1 ) % pdx->num_frames );
-		pdx->urbIdx = 0;
+	if (ret < 0) {
+		dbg("%s - nonzero read bulk status received: %d", __func__, urb->status);
+		dbg( "Error in read EP2 callback" );
+		dbg( "FrameIndex = %d", f );
+		dbg( "Bytes received before problem occurred = %lu", bytes );
+		dbg( "Urb Idx = %d", i );
+		return;
 	}
 
 	// The user interface expects us to keep listening to the
@@ -191,7 +269,6 @@ static void piusb_read_pixel_callback ( struct urb *urb )
 static int UnMapUserBuffer( struct device_extension *pdx )
 {
 	int i, k;
-	unsigned int epAddr;
 
 	if (!pdx->PixelUrb)
 		return -EINVAL; // not initialized yet
@@ -209,14 +286,6 @@ static int UnMapUserBuffer( struct device_extension *pdx )
 	}
 
 	for( k = 0; k < pdx->num_frames; k++ ) {
-		if( pdx->iama == PIXIS_PID ) { //if so, which EP should we map this frame to
-			if( k % 2 )//check to see if this should use EP4(PONG)
-				epAddr = pdx->hEP[3];//PONG, odd frames
-			else
-				epAddr = pdx->hEP[2];//PING, even frames and zero
-		} else //ST133 only has 1 endpoint for Pixel data transfer
-			epAddr = pdx->hEP[0];
-
 		//dma_unmap_sg( pdx->udev->bus->controller, pdx->sgl[k], pdx->maplist_numPagesMapped[k], DMA_FROM_DEVICE);
 		for( i = 0; i < pdx->maplist_numPagesMapped[k]; i++ )
 			page_cache_release( sg_page(&(pdx->sgl[k][i])) );
@@ -273,16 +342,9 @@ static int MapUserBuffer(ioctl_struct *io, struct device_extension *pdx )
 	if (!pdx->PixelUrb)
 		return -EINVAL; // not initialized yet
  
-	if( pdx->iama == PIXIS_PID ) { //if so, which EP should we map this frame to
-		if( frameInfo % 2 )//check to see if this should use EP4(PONG)
-			epAddr = pdx->hEP[3];//PONG, odd frames
-		else
-			epAddr = pdx->hEP[2];//PING, even frames and zero
-		dbg("Pixis Frame #%d: EP=%d",frameInfo, (epAddr==pdx->hEP[2]) ? 2 : 4 );
-	} else { //ST133 only has 1 endpoint for Pixel data transfer
-		epAddr = pdx->hEP[0];
-		dbg("ST133 Frame #%d: EP=2",frameInfo );
-	}
+	epAddr = piusb_pixel_pipe(pdx, frameInfo);
+	dbg("%s Frame #%d: EP=%d", pdx->profile->name, frameInfo,
+	    pdx->profile->pixel_ep[frameInfo % pdx->profile->num_pixel_ep]);
 	dbg("UserAddress = 0x%08lX", uaddr );
 	dbg("numbytes = %d", (int)numbytes );
 	//number of pages to map the entire user space DMA buffer
@@ -414,32 +476,30 @@ static int MapUserBuffer(ioctl_struct *io, struct device_extension *pdx )
 			  numbytes, piusb_read_pixel_callback, pdx);
 	pdx->PixelUrb[frameInfo][0]->num_sgs = num_pages;
 	pdx->PixelUrb[frameInfo][0]->sg = pdx->sgl[frameInfo];
-	err = usb_submit_urb( pdx->PixelUrb[frameInfo][0], GFP_KERNEL );
-	if( err ) {
+	err = piusb_submit_pixel_urb( pdx, frameInfo, 0, GFP_KERNEL );
+	if( err )
 		dbg( "submit urb for entry %d error = %d\n", 0, err);
-		pdx->pendedPixelUrbs[frameInfo][0] = 0;
-		return err;
-	} else
-			pdx->pendedPixelUrbs[frameInfo][0] = 1;
-	return 0;
+	return err;
 }
 
 static int get_pixel_data(struct device_extension *pdx)
 {
-	int i;
+	int i, f;
 	unsigned long numbytes;
 
-	if (!pdx->gotPixelData)
+	spin_lock_irq(&pdx->frame_lock);
+	f = piusb_fa_peek(&pdx->fa);
+	numbytes = pdx->fa.size_returned;
+	spin_unlock_irq(&pdx->frame_lock);
+	if (f < 0)
 		return 0;
 
-	pdx->gotPixelData = 0;
-	numbytes = pdx->bulk_in_size_returned;
-	pdx->bulk_in_size_returned -= pdx->frameSize;
+	for (i = 0; i < pdx->maplist_numPagesMapped[f]; i++)
+		SetPageDirty(sg_page(&pdx->sgl[f][i]));
 
-	for (i = 0; i < pdx->maplist_numPagesMapped[pdx->active_frame]; i++)
-		SetPageDirty(sg_page(&pdx->sgl[pdx->active_frame][i]));
-
-	pdx->active_frame = (pdx->active_frame + 1) % pdx->num_frames;
+	spin_lock_irq(&pdx->frame_lock);
+	piusb_fa_consume(&pdx->fa);
+	spin_unlock_irq(&pdx->frame_lock);
 
 	return numbytes;
 }
@@ -447,31 +507,30 @@ static int get_pixel_data(struct device_extension *pdx)
 static void piusb_read_pixel_callback ( struct urb *urb )
 {
 	struct device_extension *pdx = urb->context;
-	int status = urb->status;
+	unsigned long bytes;
+	int f, i, ret;
 
-	if (status &&
-	    // for these 3 errors -> we might have still received something
-	    !(status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)) {
-		dbg("%s - nonzero read bulk status received: %d", __func__, urb->status);
-		dbg( "Error in read EP2 callback" );
-		dbg( "FrameIndex = %d", pdx->frameIdx );
-		dbg( "Bytes received before problem occurred = %d", pdx->bulk_in_byte_trk );
-		dbg( "Urb Idx = %d", pdx->urbIdx );
-		pdx->pendedPixelUrbs[pdx->frameIdx][pdx->urbIdx] = 0;
-		pdx->gotPixelData = -EPIPE; // tell there is no hope
+	/* killed to be re-armed after a reset: nothing to account for */
+	if (pdx->resetting)
 		return;
-	}
 
-	pdx->bulk_in_byte_trk += urb->actual_length;
-
-	pdx->urbIdx++;  //point to next URB when we callback
-	if( pdx->bulk_in_byte_trk >= pdx->frameSize ) {
-		pdx->bulk_in_size_returned = pdx->bulk_in_byte_trk;
-		pdx->bulk_in_byte_trk = 0;
-		pdx->gotPixelData = 1;
-		pdx->frameIdx = ( ( pdx->frameIdx + 1 ) % pdx->num_frames );
-		pdx->urbIdx = 0;
+	spin_lock(&pdx->frame_lock);
+	f = pdx->fa.frame_idx;
+	i = pdx->fa.urb_idx;
+	bytes = pdx->fa.byte_trk;
+	ret = piusb_fa_complete(&pdx->fa, urb->status, urb->actual_length);
+	// the URB holds data (or failed) until get_pixel_data() resubmits it
+	pdx->pendedPixelUrbs[f][i] = 0;
+	spin_unlock(&pdx->frame_lock);
+	if (ret < 0) {
+		dbg("%s - nonzero read bulk status received: %d", __func__, urb->status);
+		dbg( "Error in read EP2 callback" );
+		dbg( "FrameIndex = %d", f );
+		dbg( "Bytes received before problem occurred = %lu", bytes );
+		dbg( "Urb Idx = %d", i );
 	}
+	if (ret)
+		wake_up_interruptible(&pdx->frame_wait);
 
 	// Without DMA mapping, it's not possible to resubmit the URB here, because
 	// the data hasn't been copied yet to the user. => we'll do it in get_pixel_data()
@@ -485,7 +544,6 @@ static int UnMapUserBuffer( struct device_extension *pdx )
 {
 	int i = 0;
 	int k = 0;
-	unsigned int epAddr;
 
 	if (!pdx->PixelUrb)
 		return -EINVAL; // not initialized yet
@@ -505,13 +563,6 @@ static int UnMapUserBuffer( struct device_extension *pdx )
 	}
 
 	for( k = 0; k < pdx->num_frames; k++ ) {
-		if( pdx->iama == PIXIS_PID ) { //if so, which EP should we map this frame to
-			if( k % 2 )//check to see if this should use EP4(PONG)
-				epAddr = pdx->hEP[3];//PONG, odd frames
-			else
-				epAddr = pdx->hEP[2];//PING, even frames and zero
-		} else //ST133 only has 1 endpoint for Pixel data transfer
-			epAddr = pdx->hEP[0];
 		kfree( pdx->PixelUrb[k] );
 		kfree( pdx->pendedPixelUrbs[k] );
 		pdx->PixelUrb[k] = NULL;
@@ -520,6 +571,10 @@ static int UnMapUserBuffer( struct device_extension *pdx )
 	kfree(pdx->user_buffer);
 	pdx->user_buffer = NULL;
 
+	spin_lock_irq(&pdx->frame_lock);
+	piusb_fa_init(&pdx->fa, pdx->frameSize, pdx->num_frames);
+	spin_unlock_irq(&pdx->frame_lock);
+
 	kfree( pdx->sgEntries );
 	vfree( pdx->maplist_numPagesMapped );
 	pdx->sgEntries = NULL;
@@ -531,12 +586,6 @@ static int UnMapUserBuffer( struct device_extension *pdx )
 	return 0;
 }
 
-/*
- * Maximum size for each allocation block, if it's too big, it might have some
- * failure being allocated. So we use 100 Kb. 1Mb seemed to work fine too, but at
- * least we are sure to test multiple URBs.
- */
-#define MAX_BUFFER_SIZE (102400)
 /**
  * Actually doesn't map the user buffer to DMA, but just write down the address,
  * and allocates kernel memory of the same size to receive the camera data. It
@@ -559,19 +608,16 @@ static int MapUserBuffer(ioctl_struct *io, struct device_extension *pdx )
 
 	pdx->user_buffer[f] = &io->data; // address of the user buffer, to copy it back
 
-	if( pdx->iama == PIXIS_PID ) { //if so, which EP should we map this frame to
-		if( f % 2 )//check to see if this should use EP4(PONG)
-			epAddr = pdx->hEP[3];//PONG, odd frames
-		else
-			epAddr = pdx->hEP[2];//PING, even frames and zero
-		dbg("Pixis Frame #%d: EP=%d",f, (epAddr==pdx->hEP[2]) ? 2 : 4 );
-	} else { //ST133 only has 1 endpoint for Pixel data transfer
-		epAddr = pdx->hEP[0];
-		dbg("ST133 Frame #%d: EP=2",f );
-	}
+	epAddr = piusb_pixel_pipe(pdx, f);
+	dbg("%s Frame #%d: EP=%d", pdx->profile->name, f,
+	    pdx->profile->pixel_ep[f % pdx->profile->num_pixel_ep]);
 	dbg("UserAddress = %p", &io->data );
 
-	buf_size = min((int)numbytes, MAX_BUFFER_SIZE);
+	buf_size = min_t(unsigned long, numbytes, pdx->profile->urb_size);
+	// bigger URBs if the frame would need too many of them
+	if (pdx->profile->queue_depth &&
+	    DIV_ROUND_UP(numbytes, buf_size) > pdx->profile->queue_depth)
+		buf_size = DIV_ROUND_UP(numbytes, pdx->profile->queue_depth);
 	numurb = numbytes / buf_size;
 	size_last = numbytes % buf_size;
 	if (size_last)
@@ -616,14 +662,11 @@ static int MapUserBuffer(ioctl_struct *io, struct device_extension *pdx )
 	}
 
 	for (i = 0; i < numurb; i++) {
-		retval = usb_submit_urb( pdx->PixelUrb[f][i], GFP_KERNEL );
+		retval = piusb_submit_pixel_urb(pdx, f, i, GFP_KERNEL);
 		if (retval) {
 			dbg( "submit urb for entry %d error = %d", i, retval);
-			pdx->pendedPixelUrbs[f][i] = 0;
 			goto error_kill;
 		}
-
-		pdx->pendedPixelUrbs[f][i] = 1;
 	}
 	return 0;
 
@@ -648,32 +691,100 @@ error:
 	return retval;
 }
 
-static int get_pixel_data(struct device_extension *pdx)
+/**
+ * Keep a copy of the frame about to be given back to the camera if one of the
+ * subscribers is waiting for it. Called with pdx->mutex held, so the list of
+ * subscribers cannot change.
+ */
+static void piusb_tap_frame(struct device_extension *pdx, struct urb **urbs, int numurb)
 {
-	struct urb **urbs = pdx->PixelUrb[pdx->active_frame];
-	__u32 *to_buf = pdx->user_buffer[pdx->active_frame];
-	__u32 numbytes;
-	int i, err;
+	struct piusb_file *pf;
+	unsigned int len = 0;
+	int wanted = 0;
+	char *dst;
+	int i, slot;
 
-	if (!pdx->gotPixelData)
-		return 0; /* not yet */
-	else if (pdx->gotPixelData < 0) {
-		err = pdx->gotPixelData;
-		pdx->gotPixelData = 0;
-		// We should return the error number, but it seems the libpvcam
-		// thinks it's just a negative length to read. So instead claim
-		// we got all
-		//return err; /* error */
-		numbytes = pdx->frameSize;
-		dbg("pretending to return %u bytes of data after err %d", numbytes, err);
-		return numbytes;
+	if (list_empty(&pdx->subscribers))
+		return;
+
+	// Never make the recorder wait for a slow subscriber: skip the frame instead
+	if (!mutex_trylock(&pdx->tap_mutex))
+		return;
+
+	list_for_each_entry(pf, &pdx->subscribers, node) {
+		if (pf->armed && pdx->fa.seq >= pf->next_seq)
+			wanted = 1;
+	}
+	if (!wanted)
+		goto unlock;
+
+	if (pdx->tap_frame_size != pdx->frameSize) {
+		vfree(pdx->tap_buf);
+		pdx->tap_frame_size = 0;
+		pdx->tap_buf = vmalloc(PIUSB_TAP_FRAMES * pdx->frameSize);
+		if (!pdx->tap_buf) {
+			dbg("Can't allocate memory for the subscribers' frames");
+			goto unlock;
+		}
+		pdx->tap_frame_size = pdx->frameSize;
+	}
+
+	slot = pdx->tap_next;
+	pdx->tap_next = (slot + 1) % PIUSB_TAP_FRAMES;
+	dst = (char *)pdx->tap_buf + slot * pdx->tap_frame_size;
+	for (i = 0; i < numurb; i++) {
+		unsigned int n = min_t(unsigned int, urbs[i]->actual_length,
+				       pdx->tap_frame_size - len);
+		memcpy(dst + len, urbs[i]->transfer_buffer, n);
+		len += n;
 	}
+	pdx->tap_seq[slot] = pdx->fa.seq;
+	pdx->tap_len[slot] = len;
+
+	list_for_each_entry(pf, &pdx->subscribers, node) {
+		if (pf->armed && pdx->fa.seq >= pf->next_seq) {
+			pf->armed = 0;
+			pf->pending_slot = slot;
+			pf->pending_seq = pdx->fa.seq;
+		}
+	}
+unlock:
+	mutex_unlock(&pdx->tap_mutex);
+}
 
-	pdx->gotPixelData = 0;
-	numbytes = pdx->bulk_in_size_returned;
-	pdx->bulk_in_size_returned -= pdx->frameSize;
+static int piusb_frames_ready(struct device_extension *pdx)
+{
+	int n;
+
+	spin_lock_irq(&pdx->frame_lock);
+	n = pdx->fa.ready;
+	spin_unlock_irq(&pdx->frame_lock);
+	return n;
+}
 
-	for (i=0; i<pdx->sgEntries[pdx->active_frame]; i++) {
+/**
+ * Copy the oldest frame received to its user buffer, and give its URBs back to
+ * the camera.
+ * Returns the number of bytes of the frame.
+ */
+static int piusb_deliver_frame(struct device_extension *pdx)
+{
+	struct urb **urbs;
+	__u32 *to_buf;
+	__u32 numbytes = 0;
+	int i, f, err;
+
+	spin_lock_irq(&pdx->frame_lock);
+	f = piusb_fa_peek(&pdx->fa);
+	spin_unlock_irq(&pdx->frame_lock);
+	if (f < 0)
+		return 0;
+	urbs = pdx->PixelUrb[f];
+	to_buf = pdx->user_buffer[f];
+
+	piusb_tap_frame(pdx, urbs, pdx->sgEntries[f]);
+
+	for (i=0; i<pdx->sgEntries[f]; i++) {
 		u16 *buf = (urbs[i]->transfer_buffer);
 		unsigned int length = urbs[i]->actual_length;
 
@@ -684,9 +795,10 @@ static int get_pixel_data(struct device_extension *pdx)
 		if (copy_to_user(to_buf, buf, length))
 			dbg("failed to copy pixel data of urb %d to user", i);
 		to_buf += length;
+		numbytes += length;
 
 		/* try to resubmitting the urb (will fail if buffer is unmapped) */
-		err = usb_submit_urb(urbs[i], GFP_KERNEL);
+		err = piusb_submit_pixel_urb(pdx, f, i, GFP_KERNEL);
 		if (err && err != -EPERM) {
 			errCnt++;
 			if(err != lastErr) {
@@ -697,12 +809,177 @@ static int get_pixel_data(struct device_extension *pdx)
 			dbg("submit urb cancelled");
 	}
 
-	pdx->active_frame = (pdx->active_frame + 1) % pdx->num_frames;
-	dbg("return %u bytes of data", numbytes);
+	spin_lock_irq(&pdx->frame_lock);
+	piusb_fa_consume(&pdx->fa);
+	spin_unlock_irq(&pdx->frame_lock);
 	return numbytes;
 }
+
+static int get_pixel_data(struct device_extension *pdx)
+{
+	__u32 numbytes;
+	int err;
+
+	spin_lock_irq(&pdx->frame_lock);
+	err = piusb_fa_take_error(&pdx->fa);
+	spin_unlock_irq(&pdx->frame_lock);
+	if (err < 0) {
+		// We should return the error number, but it seems the libpvcam
+		// thinks it's just a negative length to read. So instead claim
+		// we got all
+		//return err; /* error */
+		numbytes = pdx->frameSize;
+		dbg("pretending to return %u bytes of data after err %d", numbytes, err);
+		return numbytes;
+	}
+
+	if (!piusb_frames_ready(pdx))
+		return 0; /* not yet */
+
+	numbytes = piusb_deliver_frame(pdx);
+	dbg("return %d bytes of data", (int)numbytes);
+	return numbytes;
+}
+
+/**
+ * Returns in one go all the frames received since the last call (up to
+ * maxFrames). If a watermark is given, first waits until that many frames are
+ * received, or the timeout expires (0: no wait). The wait is done without
+ * holding the device lock. An error after some frames ends the call, which
+ * returns those frames.
+ */
+static long piusb_read_frames(struct device_extension *pdx, readframes_struct __user *arg)
+{
+	readframes_struct rf;
+	frame_desc desc;
+	frame_desc __user *to;
+	unsigned int wanted;
+	long retval = 0;
+	int n = 0;
+	int size;
+
+	if (copy_from_user(&rf, arg, sizeof(rf)))
+		return -EFAULT;
+	to = (frame_desc __user *)(unsigned long)rf.desc;
+
+	if (rf.watermark) {
+		wanted = min(rf.watermark, rf.maxFrames);
+		retval = wait_event_interruptible_timeout(pdx->frame_wait,
+				piusb_frames_ready(pdx) >= wanted ||
+				pdx->fa.error < 0 || !pdx->present,
+				msecs_to_jiffies(rf.timeout));
+		if (retval < 0)
+			return retval; // interrupted
+	}
+
+	mutex_lock(&pdx->mutex);
+	if (!pdx->present) {
+		retval = -ENODEV;
+		goto done;
+	}
+	if (!pdx->PixelUrb) {
+		retval = -EINVAL;
+		goto done;
+	}
+
+	while (n < rf.maxFrames && piusb_frames_ready(pdx)) {
+		desc.index = pdx->fa.active_frame;
+		desc.sequence = pdx->fa.seq;
+		size = piusb_deliver_frame(pdx);
+		if (size >= 0) {
+			desc.numbytes = size;
+			if (copy_to_user(&to[n], &desc, sizeof(desc)))
+				size = -EFAULT;
+		}
+		/* the frames already returned are reported, not the error */
+		if (size < 0) {
+			if (n > 0)
+				break;
+			retval = size;
+			goto done;
+		}
+		n++;
+	}
+
+	if (n == 0) {
+		spin_lock_irq(&pdx->frame_lock);
+		retval = piusb_fa_take_error(&pdx->fa);
+		spin_unlock_irq(&pdx->frame_lock);
+		if (retval < 0)
+			goto done;
+	}
+
+	rf.numFrames = n;
+	if (put_user(rf.numFrames, &arg->numFrames))
+		retval = -EFAULT;
+	else
+		retval = n;
+done:
+	mutex_unlock(&pdx->mutex);
+	return retval;
+}
 #endif
 
+/**
+ * Stop receiving pixel data, but keep the URBs and their buffers, so that the
+ * acquisition can go on after a reset or a suspend.
+ * Called with pdx->mutex held.
+ */
+static void piusb_stop_streaming(struct device_extension *pdx)
+{
+	int i, k;
+
+	pdx->resetting = 1;
+	if (!pdx->PixelUrb)
+		return;
+
+	for (k = 0; k < pdx->num_frames; k++) {
+		if (!pdx->PixelUrb[k])
+			continue; // not mapped
+		for (i = 0; i < pdx->sgEntries[k]; i++) {
+			if (pdx->pendedPixelUrbs[k][i])
+				usb_kill_urb(pdx->PixelUrb[k][i]);
+		}
+	}
+}
+
+/**
+ * Re-arm the URBs stopped by piusb_stop_streaming(). The frames already
+ * received, but not yet read, are kept. Only the frame which was being received
+ * is lost, and it is received again from its start.
+ * Called with pdx->mutex held.
+ */
+static int piusb_restart_streaming(struct device_extension *pdx)
+{
+	int partial; // URBs already received of the current frame
+	int i, k, n, err;
+	int retval = 0;
+
+	spin_lock_irq(&pdx->frame_lock);
+	partial = piusb_fa_restart(&pdx->fa);
+	spin_unlock_irq(&pdx->frame_lock);
+	pdx->resetting = 0;
+	if (!pdx->PixelUrb)
+		return 0;
+
+	/* resubmit in the order the frames are expected */
+	for (n = 0; n < pdx->num_frames; n++) {
+		k = (pdx->fa.frame_idx + n) % pdx->num_frames;
+		if (!pdx->PixelUrb[k])
+			continue;
+		for (i = 0; i < pdx->sgEntries[k]; i++) {
+			if (!pdx->pendedPixelUrbs[k][i] && !(n == 0 && i < partial))
+				continue; // holds data not yet read
+			err = piusb_submit_pixel_urb(pdx, k, i, GFP_NOIO);
+			if (err) {
+				dbg("resubmitting urb %d of frame %d failed with error %d", i, k, err);
+				retval = err;
+			}
+		}
+	}
+	return retval;
+}
+
 static int piusb_read_io(ioctl_struct *ctrl, struct device_extension *pdx, void __user *to)
 {
 	unsigned char *uBuf;
@@ -758,6 +1035,93 @@ static int piusb_read_io(ioctl_struct *ctrl, struct device_extension *pdx, void
 	return ctrl->numbytes;
 }
 
+/**
+ * Give to a subscriber the frame which was set aside for it, if any. Otherwise
+ * ask for the next one wanted, and return 0 (like PIUSB_READPIPE does when no
+ * frame is ready yet).
+ */
+static long piusb_read_tapped_frame(struct piusb_file *pf, frame_struct __user *to)
+{
+	struct device_extension *pdx = pf->pdx;
+	frame_struct fr;
+	int slot;
+	long retval = 0;
+
+	if (copy_from_user(&fr, to, sizeof(fr)))
+		return -EFAULT;
+
+	mutex_lock(&pdx->tap_mutex);
+	slot = pf->pending_slot;
+	if (slot < 0 || pdx->tap_seq[slot] != pf->pending_seq) {
+		/* nothing yet, or it was overwritten by a newer frame */
+		pf->pending_slot = -1;
+		pf->armed = 1;
+		goto done;
+	}
+
+	fr.length = min(fr.numbytes, pdx->tap_len[slot]);
+	fr.sequence = pf->pending_seq;
+	if (copy_to_user((void __user *)(unsigned long)fr.data,
+			 (char *)pdx->tap_buf + slot * pdx->tap_frame_size, fr.length) ||
+	    copy_to_user(to, &fr, sizeof(fr))) {
+		retval = -EFAULT;
+		goto done;
+	}
+
+	pf->pending_slot = -1;
+	if (pf->decimation != PIUSB_LATEST_ONLY) {
+		pf->next_seq = fr.sequence + pf->decimation;
+		pf->armed = 1;
+	}
+	retval = fr.length;
+done:
+	mutex_unlock(&pdx->tap_mutex);
+	return retval;
+}
+
+/**
+ * The subscribers cannot drive the camera, they only get some of the frames
+ * received by the controller. pdx->mutex is not taken, so that they never slow
+ * down the controller.
+ */
+static long piusb_subscriber_ioctl(struct piusb_file *pf, unsigned int cmd, unsigned long arg)
+{
+	struct device_extension *pdx = pf->pdx;
+	subscribe_struct sub;
+
+	if (!pdx->present)
+		return -ENODEV;
+
+	switch (cmd) {
+	case PIUSB_WHATCAMERA:
+		return pdx->iama;
+
+	case PIUSB_ISHIGHSPEED:
+		return (pdx->udev->speed == USB_SPEED_HIGH) ? 1 : 0;
+
+	case PIUSB_SUBSCRIBE:
+		dbg("   * PIUSB_SUBSCRIBE");
+		if (copy_from_user(&sub, (void __user *)arg, sizeof(sub)))
+			return -EFAULT;
+		if (sub.decimation < 0)
+			return -EINVAL;
+		mutex_lock(&pdx->tap_mutex);
+		pf->decimation = sub.decimation;
+		pf->next_seq = pdx->fa.seq;
+		pf->pending_slot = -1;
+		pf->armed = 1;
+		mutex_unlock(&pdx->tap_mutex);
+		return 0;
+
+	case PIUSB_READFRAME:
+		return piusb_read_tapped_frame(pf, (frame_struct __user *)arg);
+
+	default:
+		dbg("   * IOCTL 0x%x refused to a subscriber", cmd);
+		return -EPERM;
+	}
+}
+
 static void dump(const ioctl_struct *s)
 {
 	dbg("   ioctl: %p", s);
@@ -773,7 +1137,8 @@ static void dump(const ioctl_struct *s)
 // mainly about reading/writing the ioctl_struct in 32 bits.
 static long piusb_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
 {
-	struct device_extension *pdx = (struct device_extension *)file->private_data;
+	struct piusb_file *pf = (struct piusb_file *)file->private_data;
+	struct device_extension *pdx;
 	char dummyCtlBuf[] = {0,0,0,0,0,0,0,0};
 	const size_t cs = _IOC_SIZE(cmd);
 	unsigned short controlData;
@@ -783,8 +1148,15 @@ static long piusb_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
 	int err = 0;
 	u8 buf[64];
 
-	if (!pdx)
+	if (!pf)
 		return -EINVAL;
+	pdx = pf->pdx;
+	if (!pf->controller)
+		return piusb_subscriber_ioctl(pf, cmd, arg);
+#ifndef USE_DMA_MAPPING
+	if (cmd == PIUSB_READFRAMES)
+		return piusb_read_frames(pdx, (readframes_struct __user *)arg);
+#endif
 
 	dbg("> %s(file=..., cmd=0x%x, arg=...)", __func__, cmd);
 	dbg("   command size=%zd", cs);
@@ -910,33 +1282,12 @@ static long piusb_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
 		dbg("      endpoint = 0x%x", ctrl->endpoint);
 
 		/* Depending on the camera, endpoints have different meanings */
-		if (pdx->iama == PIXIS_PID) {
-			switch (ctrl->endpoint) {
-			case 0: // PIXIS IO EP0
-			case 4: // PIXIS IO EP4
-				retval = piusb_read_io(ctrl, pdx, (void __user *)arg);
-				break;
-			case 2://PIXIS Ping
-			case 3://PIXIS Pong
-				retval = get_pixel_data(pdx);
-				break;
-			default:
-				retval = -EINVAL;
-				break;
-			}
-		} else { /* ST133 */
-			switch (ctrl->endpoint) {
-			case 0://ST133 Pixel Data
-				retval = get_pixel_data(pdx);
-				break;
-			case 1://ST133 IO
-				retval = piusb_read_io(ctrl, pdx, (void __user *)arg);
-				break;
-			default:
-				retval = -EINVAL;
-				break;
-			}
-		}
+		if (piusb_is_pixel_ep(pdx, ctrl->endpoint))
+			retval = get_pixel_data(pdx);
+		else if (piusb_is_io_ep(pdx, ctrl->endpoint))
+			retval = piusb_read_io(ctrl, pdx, (void __user *)arg);
+		else
+			retval = -EINVAL;
 		break;
 
 	case PIUSB_WHATCAMERA:
@@ -954,7 +1305,7 @@ static long piusb_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		dbg("      setting frame size to %dx%u", ctrl->numFrames, ctrl->numbytes);
 
-		if ((pdx->iama == PIXIS_PID) && (ctrl->numFrames % 2)) {
+		if (ctrl->numFrames % pdx->profile->num_pixel_ep) {
 			/*
 			 * The PIXIS uses a ping-pong scheme, which means we
 			 * need to have a even number of buffer (or we would
@@ -963,22 +1314,25 @@ static long piusb_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
 			 */
 			// TODO: allow odd number, and update pipe when resubmitting URB
 			// might need to look out for Set Vendor Command = f0.
-			dev_warn(&pdx->udev->dev, "PIXIS needs an even number of "
+			dev_warn(&pdx->udev->dev, "%s needs a multiple of %d "
 				 "frame buffers, it will not work past %d frames\n",
+				 pdx->profile->name, pdx->profile->num_pixel_ep,
 				 ctrl->numFrames);
 		}
 
 		pdx->frameSize = ctrl->numbytes;
 		pdx->num_frames = ctrl->numFrames;
-		pdx->active_frame = 0;
+		spin_lock_irq(&pdx->frame_lock);
+		piusb_fa_init(&pdx->fa, pdx->frameSize, pdx->num_frames);
+		spin_unlock_irq(&pdx->frame_lock);
 
 		/* the checks shouldn't be necessary, but it makes sure there is no leak */
 		if (!pdx->sgl)
 			pdx->sgl = kmalloc(sizeof(struct scatterlist *) * pdx->num_frames, GFP_KERNEL);
 		if (!pdx->sgEntries)
-			pdx->sgEntries = kmalloc(sizeof(unsigned int) * pdx->num_frames, GFP_KERNEL);
-		if (!pdx->PixelUrb)
-			pdx->PixelUrb = kmalloc(sizeof(struct urb **) * pdx->num_frames, GFP_KERNEL);
+			pdx->sgEntries = kcalloc(pdx->num_frames, sizeof(unsigned int), GFP_KERNEL);
+		if (!pdx->PixelUrb) // zeroed, to know which frames are not mapped yet
+			pdx->PixelUrb = kcalloc(pdx->num_frames, sizeof(struct urb **), GFP_KERNEL);
 		if (!pdx->maplist_numPagesMapped)
 			pdx->maplist_numPagesMapped = vmalloc(sizeof(unsigned int) * pdx->num_frames);
 		if (!pdx->pendedPixelUrbs )
@@ -1015,13 +1369,21 @@ static void piusb_delete(struct kref *kref)
 	struct device_extension *pdx = to_pi_dev(kref);
 
 	dev_dbg(&pdx->udev->dev, "%s\n", __func__);
+	vfree(pdx->tap_buf);
 	usb_put_dev(pdx->udev);
 	kfree(pdx);
 }
 
+/**
+ *  piusb_open
+ *
+ *  An opener for writing controls the camera, only one at a time: the others
+ *  get -EBUSY. The read-only openers are always subscribers to the frames.
+ */
 static int piusb_open(struct inode *inode, struct file *file)
 {
 	struct device_extension *pdx = NULL;
+	struct piusb_file *pf;
 	struct usb_interface *interface;
 	int subminor;
 	int retval = 0;
@@ -1042,24 +1404,51 @@ static int piusb_open(struct inode *inode, struct file *file)
 	}
 	dbg( "Alternate Setting = %d", interface->num_altsetting );
 
-	pdx->frameIdx = pdx->urbIdx = 0;
-	pdx->gotPixelData = 0;
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf) {
+		retval = -ENOMEM;
+		goto exit_no_device;
+	}
+	pf->pdx = pdx;
+	pf->pending_slot = -1;
+	INIT_LIST_HEAD(&pf->node);
+
+	mutex_lock(&pdx->mutex);
+	if (!(file->f_mode & FMODE_WRITE)) {
+		pf->decimation = PIUSB_LATEST_ONLY;
+		list_add_tail(&pf->node, &pdx->subscribers);
+		mutex_unlock(&pdx->mutex);
+		dbg( "New subscriber" );
+		goto exit_opened;
+	}
+	if (pdx->controller) {
+		dbg( "Device already controlled, only read-only opening is possible" );
+		mutex_unlock(&pdx->mutex);
+		kfree(pf);
+		retval = -EBUSY;
+		goto exit_no_device;
+	}
+	pf->controller = 1;
+	pdx->controller = pf;
+
+	spin_lock_irq(&pdx->frame_lock);
+	piusb_fa_init(&pdx->fa, 0, 0);
+	spin_unlock_irq(&pdx->frame_lock);
 	pdx->pendingWrite = 0; // FIXME: never read
 	pdx->frameSize = 0;
 	pdx->num_frames = 0;
-	pdx->active_frame = 0;
-	pdx->bulk_in_byte_trk = 0;
 	pdx->userBufMapped = 0; // FIXME: never read
 	pdx->pendedPixelUrbs = NULL;
 	pdx->sgEntries = NULL;
 	pdx->sgl = NULL;
 	pdx->maplist_numPagesMapped = NULL;
 	pdx->PixelUrb = NULL;
-	pdx->bulk_in_size_returned = 0;
+	mutex_unlock(&pdx->mutex);
+exit_opened:
 	/* increment our usage count for the device */
 	kref_get(&pdx->kref);
 	/* save our object in the file's private structure */
-	file->private_data = pdx;
+	file->private_data = pf;
 exit_no_device:
 	return retval;
 }
@@ -1070,14 +1459,25 @@ exit_no_device:
 static int piusb_release(struct inode *inode, struct file *file)
 {
 	struct device_extension *pdx;
+	struct piusb_file *pf;
 	int retval = 0;
 
 	dbg( "Piusb_Release()" );
-	pdx = (struct device_extension *)file->private_data;
-	if (pdx == NULL) {
+	pf = (struct piusb_file *)file->private_data;
+	if (pf == NULL) {
 		dbg ("%s - object is NULL", __func__);
 		return -ENODEV;
 	}
+	pdx = pf->pdx;
+
+	mutex_lock(&pdx->mutex);
+	if (pf->controller)
+		pdx->controller = NULL;
+	else
+		list_del(&pf->node);
+	mutex_unlock(&pdx->mutex);
+	kfree(pf);
+
   /* decrement the count on our device */
 	kref_put(&pdx->kref, piusb_delete);
 	return retval;
@@ -1117,10 +1517,10 @@ static struct usb_class_driver piusb_class = {
 	.minor_base =	PIUSB_MINOR_BASE,
 };
 
-/* table of devices that work with this driver */
+/* table of devices that work with this driver, driver_info is the index in piusb_profiles */
 static const struct usb_device_id pi_device_table [] = {
-	{ USB_DEVICE( APA_VID, ST133_PID ) },
-	{ USB_DEVICE( APA_VID, PIXIS_PID ) },
+	{ USB_DEVICE( APA_VID, ST133_PID ), .driver_info = 0 },
+	{ USB_DEVICE( APA_VID, PIXIS_PID ), .driver_info = 1 },
 	{ }					/* Terminating entry */
 };
 MODULE_DEVICE_TABLE (usb, pi_device_table);
@@ -1148,23 +1548,27 @@ static int piusb_probe(struct usb_interface *interface, const struct usb_device_
 	}
 	kref_init( &pdx->kref );
 	mutex_init(&pdx->mutex);
+	mutex_init(&pdx->tap_mutex);
+	INIT_LIST_HEAD(&pdx->subscribers);
+	spin_lock_init(&pdx->frame_lock);
+	init_waitqueue_head(&pdx->frame_wait);
 	pdx->udev = usb_get_dev( interface_to_usbdev(interface));
 	pdx->interface = interface;
 	iface_desc = interface->cur_altsetting;
 
 	/* See if the device offered us matches what we can accept */
 	if ((pdx->udev->descriptor.idVendor != APA_VID) ||
-		((pdx->udev->descriptor.idProduct != PIXIS_PID) &&
-		 (pdx->udev->descriptor.idProduct != ST133_PID )))
-		return -ENODEV;
+	    (id->driver_info >= ARRAY_SIZE(piusb_profiles)) ||
+	    (piusb_profiles[id->driver_info].pid != pdx->udev->descriptor.idProduct)) {
+		retval = -ENODEV;
+		goto error;
+	}
 
 	pdx->iama = pdx->udev->descriptor.idProduct;
+	pdx->profile = &piusb_profiles[id->driver_info];
 
 	if( debug ) {
-		if( pdx->udev->descriptor.idProduct == PIXIS_PID )
-			dbg("Pixis Camera Found" );
-		else
-			dbg("ST133 USB Controller Found" );
+		dbg("%s Found", pdx->profile->name );
 		if( pdx->udev->speed  == USB_SPEED_HIGH )
 			dbg("Highspeed(USB2.0) Device Attached" );
 		else
@@ -1232,15 +1636,81 @@ static void piusb_disconnect(struct usb_interface *interface)
 	/* prevent device read, write and ioctl */
 	pdx->present = 0;
 	mutex_unlock(&pdx->mutex);
+	wake_up_interruptible(&pdx->frame_wait);
 
 	kref_put(&pdx->kref, piusb_delete);
 	dbg("PI USB2.0 device #%d now disconnected\n", minor);
 }
 
+/**
+ *  piusb_pre_reset
+ *
+ *  Called by the usb core before resetting the device. Instead of being
+ *  disconnected, the acquisition is only paused. The lock is kept until
+ *  piusb_post_reset(), so that no ioctl touches the device in between.
+ */
+static int piusb_pre_reset(struct usb_interface *interface)
+{
+	struct device_extension *pdx = usb_get_intfdata(interface);
+
+	mutex_lock(&pdx->mutex);
+	piusb_stop_streaming(pdx);
+	return 0;
+}
+
+/**
+ *  piusb_post_reset
+ *
+ *  Called by the usb core after the device was reset. The same URBs and
+ *  buffers are used again, so the user doesn't need to map them again.
+ */
+static int piusb_post_reset(struct usb_interface *interface)
+{
+	struct device_extension *pdx = usb_get_intfdata(interface);
+	int retval;
+
+	retval = piusb_restart_streaming(pdx);
+	mutex_unlock(&pdx->mutex);
+	dbg("Device reset, streaming re-armed (%d)", retval);
+	return retval;
+}
+
+static int piusb_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct device_extension *pdx = usb_get_intfdata(interface);
+
+	mutex_lock(&pdx->mutex);
+	piusb_stop_streaming(pdx);
+	mutex_unlock(&pdx->mutex);
+	return 0;
+}
+
+/**
+ *  piusb_resume
+ *
+ *  Also used when the device had to be reset on resume, as the buffers are
+ *  kept in both cases.
+ */
+static int piusb_resume(struct usb_interface *interface)
+{
+	struct device_extension *pdx = usb_get_intfdata(interface);
+	int retval;
+
+	mutex_lock(&pdx->mutex);
+	retval = piusb_restart_streaming(pdx);
+	mutex_unlock(&pdx->mutex);
+	return retval;
+}
+
 static struct usb_driver piusb_driver = {
 	.name =			"rspiusb",
 	.probe =		piusb_probe,
 	.disconnect =		piusb_disconnect,
+	.pre_reset =		piusb_pre_reset,
+	.post_reset =		piusb_post_reset,
+	.suspend =		piusb_suspend,
+	.resume =		piusb_resume,
+	.reset_resume =		piusb_resume,
 	.id_table =		pi_device_table,
 };
 
@@ -3,6 +3,8 @@
 #include <linux/ioctl.h>
 #include <linux/kernel.h>
 
+#include "piusb_frame.h"
+
 #define to_pi_dev(d) container_of( d, struct device_extension, kref )
 
 #define PIUSB_MAGIC     'm'
@@ -16,6 +18,11 @@
 #define PIUSB_USERBUFFER    _IOW( PIUSB_MAGIC, PIUSB_IOCTL_BASE + 7, ioctl_struct  )
 #define PIUSB_ISHIGHSPEED   _IO( PIUSB_MAGIC,  PIUSB_IOCTL_BASE + 8 )
 #define PIUSB_UNMAP_USERBUFFER  _IOW( PIUSB_MAGIC, PIUSB_IOCTL_BASE + 9, ioctl_struct  )
+/* Only available to the read-only subscribers */
+#define PIUSB_SUBSCRIBE     _IOW( PIUSB_MAGIC, PIUSB_IOCTL_BASE + 10, subscribe_struct )
+#define PIUSB_READFRAME     _IOWR( PIUSB_MAGIC, PIUSB_IOCTL_BASE + 11, frame_struct )
+/* Returns all the frames received since the last call */
+#define PIUSB_READFRAMES    _IOWR( PIUSB_MAGIC, PIUSB_IOCTL_BASE + 12, readframes_struct )
 
 
 /* Define these values to match your devices */
@@ -30,17 +37,51 @@
 #define PIUSB_MINOR_BASE    192
 #endif
 
+/* Decimation asking only for the most recent frame */
+#define PIUSB_LATEST_ONLY   0
+
+/* Number of recent frames set aside for the subscribers */
+#define PIUSB_TAP_FRAMES    4
+
+struct device_extension;
+
+/* Maximum number of pixel (or IO) endpoints of a controller */
+#define PIUSB_MAX_EP        2
+
+/* Transfer settings of each model of controller */
+struct piusb_profile {
+    __u16                   pid;
+    const char*             name;
+    int                     num_pixel_ep;   /* if more than one, frames alternate (ping-pong) */
+    int                     pixel_ep[PIUSB_MAX_EP]; /* index in hEP[] */
+    int                     num_io_ep;
+    int                     io_ep[PIUSB_MAX_EP];
+    unsigned int            urb_size;       /* default size of each pixel URB */
+    unsigned int            queue_depth;    /* maximum number of URBs per frame, 0 for no limit */
+};
+
+/*
+ * One per open file. The opener for writing controls the camera, the ones
+ * opening read-only are subscribers, only receiving a copy of some frames.
+ */
+struct piusb_file {
+    struct device_extension* pdx;
+    int                     controller;     /* allowed to drive the camera */
+    struct list_head        node;           /* in pdx->subscribers */
+    int                     decimation;     /* every Nth frame, or PIUSB_LATEST_ONLY */
+    int                     armed;          /* waiting for a frame to be set aside */
+    __u64                   next_seq;       /* first frame sequence number wanted */
+    int                     pending_slot;   /* tap slot holding our frame, or -1 */
+    __u64                   pending_seq;
+};
+
 /* local function prototypes */
 /* Structure to hold all of our device specific stuff */
 struct device_extension {
     struct usb_device*      udev;           /* save off the usb device pointer */
     struct usb_interface*   interface;      /* the interface for this device */
     unsigned char           minor;          /* the starting minor number for this device */
-    size_t                  bulk_in_size_returned;
-    int                     bulk_in_byte_trk;
     struct urb***           PixelUrb;
-    int                     frameIdx;
-    int                     urbIdx;
     unsigned int*           maplist_numPagesMapped;
     int                     open;           /* if the port is open or not */
     int                     present;        /* if the device is not disconnected */
@@ -48,15 +89,26 @@ struct device_extension {
     struct scatterlist**    sgl;            /* scatter-gather list for user buffer */
     unsigned int*           sgEntries;
     struct  kref            kref;
-    int                     gotPixelData;
     int                     pendingWrite;
+    int                     resetting;      /* pixel URBs stopped, to be re-armed */
     char**                  pendedPixelUrbs;
     __u32**                 user_buffer;
     int                     iama;           /*PIXIS or ST133 */
+    const struct piusb_profile* profile;    /* transfer settings of this model */
     int                     num_frames;     /* the number of frames that will fit in the user buffer */
-    int                     active_frame;
     unsigned long           frameSize;
     struct mutex			mutex;			/* acquire it before accessing the device */
+    struct piusb_file*      controller;     /* the opener driving the acquisition */
+    struct list_head        subscribers;    /* the read-only openers */
+    struct mutex            tap_mutex;      /* protects the tap ring and the subscribers' cursors */
+    void*                   tap_buf;        /* copies of the frames wanted by the subscribers */
+    unsigned long           tap_frame_size;
+    __u64                   tap_seq[PIUSB_TAP_FRAMES];
+    unsigned int            tap_len[PIUSB_TAP_FRAMES];
+    int                     tap_next;
+    spinlock_t              frame_lock;     /* protects fa */
+    struct piusb_frame_asm  fa;             /* frame assembly of the pixel data */
+    wait_queue_head_t       frame_wait;     /* woken up when a frame is received */
     //FX2 specific endpoints
     unsigned int        hEP[8];
 };
@@ -71,4 +123,33 @@ typedef struct IOCTL_STRUCT
     __u32 data;
 } ioctl_struct;
 
+typedef struct SUBSCRIBE_STRUCT
+{
+    __s32 decimation; // deliver every Nth frame, or PIUSB_LATEST_ONLY
+} subscribe_struct;
+
+typedef struct FRAME_STRUCT
+{
+    __u64 data;     // user buffer receiving the frame
+    __u32 numbytes; // size of the buffer
+    __u32 length;   // out: number of bytes copied
+    __u64 sequence; // out: sequence number of the frame
+} frame_struct;
+
+typedef struct FRAME_DESC
+{
+    __u32 index;    // frame (user buffer) number, as passed to PIUSB_USERBUFFER
+    __u32 numbytes; // number of bytes received
+    __u64 sequence; // sequence number of the frame
+} frame_desc;
+
+typedef struct READFRAMES_STRUCT
+{
+    __u64 desc;      // user array of frame_desc, filled
+    __u32 maxFrames; // size of the array
+    __u32 watermark; // if not 0, wait until so many frames are received...
+    __u32 timeout;   // ... or this many ms (0: don't wait)
+    __u32 numFrames; // out: number of frames returned
+} readframes_struct;
+
 